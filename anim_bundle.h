@@ -0,0 +1,161 @@
+// anim_bundle.h - reader for the binary animation bundle written by psd2anim
+//
+// The bundle is meant to be mmap'ed and used in place: every table is
+// little-endian, naturally aligned and addressed by absolute file offsets,
+// so after anim_bundle_validate() succeeds no parsing or allocation is
+// needed. Readers on big-endian hosts are rejected by the magic check.
+//
+//   header   anim_bundle_header
+//   layers   anim_bundle_layer[layer_count], bottom layer first
+//   frames   anim_bundle_frame[frame_count]
+//   states   anim_bundle_state[frame_count * layer_count], frame major
+//   names    NUL-terminated layer names
+//   pixels   per layer, BGRA8 rows of width * 4 bytes, ANIM_BUNDLE_ALIGN aligned
+
+#ifndef ANIM_BUNDLE_H
+#define ANIM_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ANIM_BUNDLE_MAGIC 0x42413250u    // "P2AB"
+#define ANIM_BUNDLE_VERSION 2
+#define ANIM_BUNDLE_ALIGN 64
+
+#define ANIM_BUNDLE_LAYER_HIDDEN 1u    // hidden in the document itself
+#define ANIM_BUNDLE_LAYER_OPAQUE 2u    // every payload pixel has alpha 255
+
+typedef struct anim_bundle_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t layer_count;
+    uint32_t frame_count;    // at least 1, a still image has one frame
+    uint32_t layer_table;
+    uint32_t frame_table;
+    uint32_t state_table;
+    uint32_t name_table;
+    uint64_t file_size;
+    uint32_t reserved[4];
+} anim_bundle_header;
+
+typedef struct anim_bundle_layer {
+    int32_t x;    // canvas position of the pixel payload, cropped to alpha
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    uint32_t name;    // offset of the name
+    uint64_t pixels;    // offset of the pixel payload, 0 if empty
+    uint32_t opacity;    // 0..255, combined with the opacity of its groups
+    uint32_t blend;    // Photoshop blend key as a four-char constant, 'norm' is 0x6e6f726d
+} anim_bundle_layer;
+
+typedef struct anim_bundle_frame {
+    uint32_t delay;    // as stored by Photoshop, 1/100 s
+    uint32_t reserved;
+} anim_bundle_frame;
+
+typedef struct anim_bundle_state {
+    int32_t dx;    // added to the layer position in this frame
+    int32_t dy;
+    uint32_t visible;    // combined with the visibility of its groups
+} anim_bundle_state;
+
+enum anim_bundle_error {
+    anim_bundle_ok,
+    anim_bundle_error_size,
+    anim_bundle_error_magic,
+    anim_bundle_error_version,
+    anim_bundle_error_table,
+    anim_bundle_error_name,
+    anim_bundle_error_pixels,
+};
+
+static inline const anim_bundle_header *anim_bundle_get(const void *data)
+{
+    return (const anim_bundle_header *)data;
+}
+
+static inline const anim_bundle_layer *anim_bundle_layers(const anim_bundle_header *h)
+{
+    return (const anim_bundle_layer *)((const char *)h + h->layer_table);
+}
+
+static inline const anim_bundle_frame *anim_bundle_frames(const anim_bundle_header *h)
+{
+    return (const anim_bundle_frame *)((const char *)h + h->frame_table);
+}
+
+static inline const anim_bundle_state *anim_bundle_states(const anim_bundle_header *h, uint32_t frame)
+{
+    return (const anim_bundle_state *)((const char *)h + h->state_table) + (size_t)frame * h->layer_count;
+}
+
+static inline const char *anim_bundle_layer_name(const anim_bundle_header *h, uint32_t layer)
+{
+    return (const char *)h + anim_bundle_layers(h)[layer].name;
+}
+
+static inline const uint8_t *anim_bundle_layer_pixels(const anim_bundle_header *h, uint32_t layer)
+{
+    const anim_bundle_layer *l = &anim_bundle_layers(h)[layer];
+    return l->pixels ? (const uint8_t *)h + l->pixels : 0;
+}
+
+static inline int anim_bundle_range_ok(uint64_t ofs, uint64_t bytes, uint64_t align, uint64_t size)
+{
+    return ofs % align == 0 && ofs <= size && bytes <= size - ofs;
+}
+
+// Checks every offset and size against the mapping, call once after mmap.
+// data must be at least 8 byte aligned (mmap and malloc both are).
+static inline enum anim_bundle_error anim_bundle_validate(const void *data, size_t size)
+{
+    const anim_bundle_header *h = anim_bundle_get(data);
+    const anim_bundle_layer *layers;
+    uint64_t states;
+    uint32_t i;
+
+    if (size < sizeof(anim_bundle_header))
+        return anim_bundle_error_size;
+    if (h->magic != ANIM_BUNDLE_MAGIC)
+        return anim_bundle_error_magic;
+    if (h->version != ANIM_BUNDLE_VERSION || h->header_size != sizeof(anim_bundle_header))
+        return anim_bundle_error_version;
+    if (h->file_size != size || h->frame_count == 0)
+        return anim_bundle_error_size;
+
+    states = (uint64_t)h->frame_count * h->layer_count;
+    if (!anim_bundle_range_ok(h->layer_table, (uint64_t)h->layer_count * sizeof(anim_bundle_layer), 8, size)
+        || !anim_bundle_range_ok(h->frame_table, (uint64_t)h->frame_count * sizeof(anim_bundle_frame), 4, size)
+        || !anim_bundle_range_ok(h->state_table, states * sizeof(anim_bundle_state), 4, size)
+        || !anim_bundle_range_ok(h->name_table, 0, 1, size))
+        return anim_bundle_error_table;
+
+    layers = anim_bundle_layers(h);
+    for (i = 0; i != h->layer_count; ++i)
+    {
+        const anim_bundle_layer *l = &layers[i];
+        const char *name = (const char *)data + l->name;
+        uint64_t bytes = (uint64_t)l->width * l->height * 4;
+
+        if (l->name < h->name_table || l->name >= size)
+            return anim_bundle_error_name;
+        while (*name)
+            if ((size_t)(++name - (const char *)data) >= size)
+                return anim_bundle_error_name;
+
+        // width * height * 4 can wrap around in 64 bits
+        if (l->height && l->width > (size / 4) / l->height)
+            return anim_bundle_error_pixels;
+        if (l->pixels ? !anim_bundle_range_ok(l->pixels, bytes, ANIM_BUNDLE_ALIGN, size) : bytes != 0)
+            return anim_bundle_error_pixels;
+    }
+
+    return anim_bundle_ok;
+}
+
+#endif
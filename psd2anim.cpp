@@ -5,8 +5,28 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <string>
 #include <vector>
+#include <list>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#include "anim_bundle.h"
 
 #define VA_FCC(sig) (sig >> 24), (sig >> 16), (sig >> 8), (sig)
 
@@ -14,18 +34,16 @@
 #define LogParse(x,...) false
 #define LogStdio(x,...) false
 
-#define LogDebug printf
-#define LogParse printf
+// loader messages go to the log sink of each load, see load_options; the
+// arguments are only evaluated when there is a sink
+#define LogDebug(...) (opts_.log_ ? log(__VA_ARGS__) : (void)0)
+#define LogParse(...) (opts_.log_ ? log(__VA_ARGS__) : (void)0)
 #define LogStdio printf
 
-char *indent(int lvl)
+std::string indent(int lvl)
 {
     const int buf_size = 256;
-    static char buf[buf_size];
-    sprintf(buf, "");
-    while (lvl-- && lvl < buf_size)
-        strcat(buf, "\t");
-    return buf;
+    return std::string(std::max(0, std::min(lvl, buf_size - 1)), '\t');
 }
 
 int round_int(int offset, int align)
@@ -38,6 +56,7 @@ namespace psdlite {
     typedef unsigned char u8;
     typedef unsigned short u16;
     typedef unsigned int u32;
+    typedef unsigned long long u64;
 
     typedef char s8;
     typedef short s16;
@@ -54,6 +73,32 @@ namespace psdlite {
         int x, y;
     };
 
+    struct recti {
+        recti():x0(0), y0(0), x1(0), y1(0) {
+        }
+
+        recti(int ax0, int ay0, int ax1, int ay1):x0(ax0), y0(ay0), x1(ax1), y1(ay1) {
+        }
+
+        bool empty() const {
+            return x0 >= x1 || y0 >= y1;
+        }
+
+        u64 area() const {
+            return empty() ? 0 : (u64) (x1 - x0) * (y1 - y0);
+        }
+
+        recti intersect(const recti & r) const {
+            return recti(std::max(x0, r.x0), std::max(y0, r.y0), std::min(x1, r.x1), std::min(y1, r.y1));
+        }
+
+        recti unite(const recti & r) const {
+            return recti(std::min(x0, r.x0), std::min(y0, r.y0), std::max(x1, r.x1), std::max(y1, r.y1));
+        }
+
+        int x0, y0, x1, y1;    // x1, y1 exclusive
+    };
+
     struct pixel {
         static const u32 CHANNELS = 4;
           pixel() {
@@ -61,6 +106,13 @@ namespace psdlite {
                 v[i] = 128;
         };
 
+        pixel(u8 a, u8 r, u8 g, u8 b) {
+            v[0] = a;
+            v[1] = r;
+            v[2] = g;
+            v[3] = b;
+        }
+
         u8 a() {
             return v[0];
         }
@@ -77,735 +129,2976 @@ namespace psdlite {
         u8 v[CHANNELS];
     };
 
-    struct bitmap {
-        bitmap() {
-        } bitmap(int width, int height) {
-            resize(width, height);
-        }
+    // PackBits, the same RLE scheme PSD uses for channel data
+    inline void packbits_encode(const u8 * src, int n, std::vector < u8 > &out) {
+        for (int i = 0; i < n;)
+        {
+            int run = 1;
+            while (i + run < n && run < 128 && src[i + run] == src[i])
+                ++run;
 
-        void resize(int width, int height) {
-            size_.set(width, height);
-            data_.resize(width * height);
-        }
+            if (run > 1)
+            {
+                out.push_back((u8) (1 - run));
+                out.push_back(src[i]);
+                i += run;
+                continue;
+            }
 
-        const pixel get_pixel(int x, int y) const {
-            if (0 <= x && x < size_.x && 0 <= y && y < size_.y)
-                return data_[y * size_.x + x];
-            return pixel();
-        } void set_pixel(int x, int y, const pixel & p) {
-            if (0 <= x && x < size_.x && 0 <= y && y < size_.y)
-                data_[y * size_.x + x] = p;
-        }
+            int lit = 1;
+            while (i + lit < n && lit < 128 && !(i + lit + 1 < n && src[i + lit] == src[i + lit + 1]))
+                ++lit;
 
-        void set_single_channel(int x, int y, u32 channel, u8 v) {
-            if (0 <= x && x < size_.x && 0 <= y && y < size_.y && channel < pixel::CHANNELS)
-                data_[y * size_.x + x].v[channel] = v;
+            out.push_back((u8) (lit - 1));
+            out.insert(out.end(), src + i, src + i + lit);
+            i += lit;
         }
+    }
 
-        void set_channel_count(u32 channel_count) {
-            channel_count_ = channel_count;
+    inline const u8 *packbits_decode(const u8 * src, u8 * dst, int n) {
+        for (int x = 0; x < n;)
+        {
+            int control_byte = (signed char)*src++;
+            if (control_byte < 0)
+            {
+                u8 v = *src++;
+                for (int count = 1 - control_byte; count && x < n; --count)
+                    dst[x++] = v;
+            }
+            else
+            {
+                for (int count = 1 + control_byte; count && x < n; --count)
+                    dst[x++] = *src++;
+            }
         }
+        return src;
+    }
 
-        u32 get_channel_count() {
-            return channel_count_;
+    struct tile {
+        tile():resident_(false) {
         }
 
-        const vi2 & get_size() const {
-            return size_;
-} private:
-          std::vector < pixel > data_;
-        vi2 size_;
-        u32 channel_count_;
-    };
-
-    struct animation {
-        vi2 offs_;
-        int enabled;
-    };
-
-    struct layer {
-        std::string name_;
-        vi2 offs_;
-        bitmap data_;
-        int flags;
-    };
-
-    struct layered_image {
-        vi2 size_;
-          std::vector < layer > layers_;
-    };
-
-    enum error_code {
-        error_code_no_error,
-        error_code_not_supported,
-        error_code_invalid_file,
+        std::vector < pixel > data_;    // resident pixels
+        std::vector < u8 > packed_;    // PackBits planes while evicted
+        std::list < u32 >::iterator lru_;
+        bool resident_;
     };
 
-    error_code load_layered_image(layered_image & dest, const char *fname);
-}
+    // Owns the tiles of every tiled bitmap in a document. Once the resident
+    // pixels exceed the budget the least recently used tiles are packed and
+    // their pixel memory released until they are touched again.
+    struct tile_store {
+        static const int TILE_SIZE = 256;
+        static const u32 NO_TILE = 0xffffffff;    // never written, reads as pixel()
+        static const u32 CLEAR_TILE = 0xfffffffe;    // dropped, fully transparent
 
-namespace psdlite {
-    struct buffered_file {
-        buffered_file(const char *fname):iter_(0) {
-            mem_.clear();
-            FILE *f = fopen(fname, "rb");
-            if (!f)
-                  return;
+        tile_store():budget_(0), min_budget_(0), resident_(0), packed_(0), evictions_(0) {
+        }
 
-              fseek(f, 0, SEEK_END);
-              mem_.resize(ftell(f));
-              fseek(f, 0, SEEK_SET);
-              fread(&mem_[0], mem_.size(), 1, f);
-              fclose(f);
-        } size_t get_pos() {
-            return iter_;
-        } void set_pos(size_t pos) {
-            iter_ = pos;
-            if (iter_ > mem_.size())
-            {
-                throw error_code_invalid_file;
-            }
+        void set_budget(size_t bytes) {
+            budget_ = bytes;
         }
 
-        void pad_even() {
-            iter_ = (iter_ + 1) & ~1;
-            if (iter_ > mem_.size())
-            {
-                throw error_code_invalid_file;
-            }
+        // Rows are decoded and read across a whole bitmap, so a budget below
+        // a row of its tiles would pack and unpack them on every row. The
+        // budget never drops below two tile rows of the widest bitmap, one
+        // for the row itself and one for the mip rows built alongside it.
+        void reserve_row(int tiles) {
+            size_t bytes = 2 * (size_t) tiles * tile_bytes();
+            if (min_budget_ < bytes)
+                min_budget_ = bytes;
         }
 
-        u32 getKey() {
-            u32 len = getu32();
-            if (len == 0)
-                len = getu32();
-            else
-                skip(len);
-            return len;
+        bool enabled() const {
+            return budget_ != 0;
         }
 
-        s32 gets32() {
-            return (s32) getu32();
+        void clear() {
+            tiles_.clear();
+            lru_.clear();
+            free_.clear();
+            resident_ = packed_ = 0;
+            min_budget_ = 0;
+            evictions_ = 0;
         }
 
-        u32 getu32() {
-            if (iter_ + 4 > mem_.size())
+        u32 alloc(const pixel & fill) {
+            u32 id;
+            if (!free_.empty())
             {
-                throw error_code_invalid_file;
+                id = free_.back();
+                free_.pop_back();
             }
-
-            u8 *p = (u8 *) & mem_[iter_];
-            iter_ += 4;
-            return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
-        }
-
-        u16 getu16() {
-            if (iter_ + 2 > mem_.size())
+            else
             {
-                throw error_code_invalid_file;
+                id = (u32) tiles_.size();
+                tiles_.push_back(tile());
             }
 
-            u8 *p = (u8 *) & mem_[iter_];
-            iter_ += 2;
-            return (p[0] << 8) | p[1];
+            tile & t = tiles_[id];
+            t.data_.assign(TILE_SIZE * TILE_SIZE, fill);
+            make_resident(id);
+            return id;
         }
 
-        s16 gets16() {
-            return (s16) getu16();
+        void release(u32 id) {
+            tile & t = tiles_[id];
+            if (t.resident_)
+            {
+                lru_.erase(t.lru_);
+                resident_ -= tile_bytes();
+            }
+            packed_ -= t.packed_.size();
+            std::vector < pixel > ().swap(t.data_);
+            std::vector < u8 > ().swap(t.packed_);
+            t.resident_ = false;
+            free_.push_back(id);
         }
 
-        u8 getu8() {
-            if (iter_ + 1 > mem_.size())
+        pixel *fetch(u32 id) {
+            tile & t = tiles_[id];
+            if (!t.resident_)
             {
-                throw error_code_invalid_file;
+                unpack(t);
+                make_resident(id);
             }
-
-            u8 *p = (u8 *) & mem_[iter_];
-            iter_ += 1;
-            return p[0];
+            else if (t.lru_ != lru_.begin())
+                lru_.splice(lru_.begin(), lru_, t.lru_);
+            return &t.data_[0];
         }
 
-        s8 gets8() {
-            return (s8) getu8();
+        size_t get_resident_bytes() const {
+            return resident_;
         }
 
-        void skip(u32 bytes) {
-            iter_ += bytes;
+        size_t get_packed_bytes() const {
+            return packed_;
+        }
 
-            if (iter_ > mem_.size())
-            {
-                throw error_code_invalid_file;
-            }
+        u32 get_evictions() const {
+            return evictions_;
         }
 
-        void skip_pstring() {
-            u8 s = getu8();
-            skip(s);
-            pad_even();
+private:
+        static size_t tile_bytes() {
+            return TILE_SIZE * TILE_SIZE * sizeof(pixel);
         }
 
-        void skip_ustring() {
-            u32 s = getu32();
-            skip(s * 2);
+        void make_resident(u32 id) {
+            tile & t = tiles_[id];
+            t.resident_ = true;
+            lru_.push_front(id);
+            t.lru_ = lru_.begin();
+            resident_ += tile_bytes();
+
+            // never evict the tile being handed out
+            while (resident_ > std::max(budget_, min_budget_) && lru_.size() > 1)
+                evict(lru_.back());
         }
 
-        int get_pstring(std::string & str) {
-            u8 s = getu8();
-            iter_ += s;
-            if (iter_ > mem_.size())
+        void evict(u32 id) {
+            tile & t = tiles_[id];
+            std::vector < u8 > plane(TILE_SIZE * TILE_SIZE);
+            t.packed_.clear();
+            for (u32 c = 0; c != pixel::CHANNELS; ++c)
             {
-                throw error_code_invalid_file;
+                for (u32 i = 0; i != plane.size(); ++i)
+                    plane[i] = t.data_[i].v[c];
+                packbits_encode(&plane[0], (int)plane.size(), t.packed_);
             }
+            packed_ += t.packed_.size();
+            std::vector < pixel > ().swap(t.data_);
 
-            str.assign(&mem_[iter_ - s], &mem_[iter_]);
-            pad_even();
-            return s + 1;
-        }
-
-        int getu32p(int ofs) {
-            u8 *p = (u8 *) & mem_[iter_];
-            p += ofs;
-            return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            lru_.erase(t.lru_);
+            t.resident_ = false;
+            resident_ -= tile_bytes();
+            evictions_++;
         }
 
-        void dumpHex(u32 bytes) {
-            for (int i = 0; i < bytes; i++)
+        void unpack(tile & t) {
+            std::vector < u8 > plane(TILE_SIZE * TILE_SIZE);
+            t.data_.resize(TILE_SIZE * TILE_SIZE);
+            const u8 *src = &t.packed_[0];
+            for (u32 c = 0; c != pixel::CHANNELS; ++c)
             {
-                unsigned char b = (unsigned char)mem_[iter_ + i];
-                unsigned char c = b;
-                if (b < 32 || b > 128)
-                    c = ' ';
-                printf("%04d: %02x %c", i, b, c);
-                printf(i == (bytes - 1) ? "\n\n" : "\n");
+                src = packbits_decode(src, &plane[0], (int)plane.size());
+                for (u32 i = 0; i != plane.size(); ++i)
+                    t.data_[i].v[c] = plane[i];
             }
-            iter_ += bytes;
+            packed_ -= t.packed_.size();
+            std::vector < u8 > ().swap(t.packed_);
         }
 
-protected:
-        std::vector < s8 > mem_;
-        size_t iter_;
+        size_t budget_;
+        size_t min_budget_;
+        size_t resident_;
+        size_t packed_;
+        u32 evictions_;
+        std::deque < tile > tiles_;
+        std::list < u32 > lru_;
+        std::vector < u32 > free_;
     };
 
-    /////////////////////////////////////////////////////////////
-
-    struct loader {
-        loader(buffered_file & file):file_(file) {
-            m_layer = -1;
-            m_frame = -1;
-        } int m_layer;
-        int m_frame;
+    const u32 tile_store::NO_TILE;
+    const u32 tile_store::CLEAR_TILE;
 
-        void next_layer() {
-            m_layer++;
-            m_frame = -1;
+    // Pixels are either one dense allocation or, when a tile store is set,
+    // TILE_SIZE tiles owned by the store (copies of a tiled bitmap alias the
+    // same tiles).
+    struct bitmap {
+        bitmap():has_alpha_(true), store_(0) {
+        } bitmap(int width, int height):has_alpha_(true), store_(0) {
+            resize(width, height);
         }
 
-        void next_frame() {
-            m_frame++;
+        // must be called before resize()
+        void set_tile_store(tile_store * store) {
+            store_ = store;
         }
 
-        void set_frame_delay(layered_image & dest, int delay) {
-            LogDebug("frame %d, delay: %d\n", m_frame, delay);
+        bool is_tiled() const {
+            return store_ != 0;
         }
 
-        void set_layer_visible(layered_image & dest, int visible) {
-            LogDebug("layer: %d, frame %d, visible: %d\n", m_layer, m_frame, visible);
+        void resize(int width, int height) {
+            size_.set(width, height);
+            if (store_)
+            {
+                const int T = tile_store::TILE_SIZE;
+                release_tiles();
+                tiles_.set((width + T - 1) / T, (height + T - 1) / T);
+                tile_ids_.assign((size_t) tiles_.x * tiles_.y, tile_store::NO_TILE);
+                store_->reserve_row(tiles_.x);
+            }
+            else
+                data_.resize((size_t) width * height);
         }
 
-        void set_layer_dx(layered_image & dest, int dx) {
-            LogDebug("layer: %d, frame %d, dx: %d\n", m_layer, m_frame, dx);
+        const pixel get_pixel(int x, int y) const {
+            if (0 <= x && x < size_.x && 0 <= y && y < size_.y)
+            {
+                if (!store_)
+                    return data_[(size_t) y * size_.x + x];
+
+                const int T = tile_store::TILE_SIZE;
+                u32 id = tile_ids_[(y / T) * tiles_.x + x / T];
+                if (id == tile_store::NO_TILE)
+                    return pixel();
+                if (id == tile_store::CLEAR_TILE)
+                    return pixel(0, 0, 0, 0);
+                return store_->fetch(id)[(y % T) * T + x % T];
+            }
+            return pixel();
+        } void set_pixel(int x, int y, const pixel & p) {
+            if (0 <= x && x < size_.x && 0 <= y && y < size_.y)
+                *pixel_for_write(x, y) = p;
         }
 
-        void set_frame_layer_dy(layered_image & dest, int dy) {
-            LogDebug("layer: %d, frame %d, dy: %d\n", m_layer, m_frame, dy);
+        void set_single_channel(int x, int y, u32 channel, u8 v) {
+            if (0 <= x && x < size_.x && 0 <= y && y < size_.y && channel < pixel::CHANNELS)
+                pixel_for_write(x, y)->v[channel] = v;
         }
 
-private:
-        buffered_file & file_;
-
-        void operator=(const loader &) {
-        };        // no assignement operator
-
-        void parse_header(layered_image & dest) {
-            u32 sig = file_.getu32();
-            (void)sig;
-
-            u16 ver = file_.getu16();
-            (void)ver;
-
-            file_.skip(6);
+        // write one channel of a full row
+        void set_channel_row(int y, u32 channel, const u8 * src) {
+            if (y < 0 || y >= size_.y || channel >= pixel::CHANNELS)
+                return;
 
-            u16 channels = file_.getu16();
-            (void)channels;
+            if (!store_)
+            {
+                pixel *dst = &data_[(size_t) y * size_.x];
+                for (int x = 0; x != size_.x; ++x)
+                    dst[x].v[channel] = src[x];
+                return;
+            }
 
-            u32 rows = file_.getu32();
-            u32 columns = file_.getu32();
+            const int T = tile_store::TILE_SIZE;
+            for (int x0 = 0; x0 < size_.x; x0 += T)
+            {
+                pixel *dst = pixel_for_write(x0, y);
+                int n = std::min(T, size_.x - x0);
+                for (int x = 0; x != n; ++x)
+                    dst[x].v[channel] = src[x0 + x];
+            }
+        }
 
-            dest.size_.set(columns, rows);
+        // copy one full row into out (size_.x pixels)
+        void get_row(int y, pixel * out) const {
+            if (!store_)
+            {
+                std::copy(data_.begin() + (size_t) y * size_.x, data_.begin() + (size_t) (y + 1) * size_.x, out);
+                return;
+            }
 
-            u16 depth = file_.getu16();
-            if (depth != 8)
+            const int T = tile_store::TILE_SIZE;
+            for (int tx = 0; tx != tiles_.x; ++tx)
             {
-                throw error_code_not_supported;    // only support 8bit depth
+                int x0 = tx * T;
+                int n = std::min(T, size_.x - x0);
+                u32 id = tile_ids_[(y / T) * tiles_.x + tx];
+                if (id == tile_store::NO_TILE)
+                    std::fill(out + x0, out + x0 + n, pixel());
+                else if (id == tile_store::CLEAR_TILE)
+                    std::fill(out + x0, out + x0 + n, pixel(0, 0, 0, 0));
+                else
+                {
+                    const pixel *src = store_->fetch(id) + (y % T) * T;
+                    std::copy(src, src + n, out + x0);
+                }
             }
+        }
 
-            u16 mode = file_.getu16();
+        // drop tiles with no visible pixels, they read back as transparent
+        void compact() {
+            if (!store_ || !has_alpha_)
+                return;
 
-            if (mode != 3)
+            const int T = tile_store::TILE_SIZE;
+            for (int ty = 0; ty != tiles_.y; ++ty)
             {
-                throw error_code_not_supported;    // only support RGB mode
+                for (int tx = 0; tx != tiles_.x; ++tx)
+                {
+                    u32 & id = tile_ids_[ty * tiles_.x + tx];
+                    if (id >= tile_store::CLEAR_TILE)
+                        continue;
+
+                    const pixel *p = store_->fetch(id);
+                    int w = std::min(T, size_.x - tx * T);
+                    int h = std::min(T, size_.y - ty * T);
+                    bool clear = true;
+                    for (int y = 0; clear && y != h; ++y)
+                        for (int x = 0; x != w; ++x)
+                            clear &= (p[y * T + x].v[0] == 0);
+
+                    if (clear)
+                    {
+                        store_->release(id);
+                        id = tile_store::CLEAR_TILE;
+                    }
+                }
             }
         }
 
-        void _skip_block() {
-            u32 size = file_.getu32();
-            file_.dumpHex(size);
+        // false when the source had no alpha channel, pixels are then opaque
+        // whatever their alpha byte holds
+        void set_has_alpha(bool has_alpha) {
+            has_alpha_ = has_alpha;
         }
 
-        void skip_block() {
-            u32 size = file_.getu32();
-            file_.skip(size);
+        bool has_alpha() const {
+            return has_alpha_;
         }
 
-        void parse_animation_block_data(layered_image & dest) {
+        const vi2 & get_size() const {
+            return size_;
+} private:
+        pixel * pixel_for_write(int x, int y) {
+            if (!store_)
+                return &data_[(size_t) y * size_.x + x];
+
+            const int T = tile_store::TILE_SIZE;
+            u32 & id = tile_ids_[(y / T) * tiles_.x + x / T];
+            if (id == tile_store::NO_TILE)
+                id = store_->alloc(pixel());
+            else if (id == tile_store::CLEAR_TILE)
+                id = store_->alloc(pixel(0, 0, 0, 0));
+            return store_->fetch(id) + (y % T) * T + x % T;
+        }
 
-            u32 id = file_.getu32();    //'8BIM'
-            u32 type = file_.getu32();    //'AnDs'
-            u32 size = file_.getu32();    //size
+        void release_tiles() {
+            for (u32 i = 0; i != tile_ids_.size(); ++i)
+                if (tile_ids_[i] < tile_store::CLEAR_TILE)
+                    store_->release(tile_ids_[i]);
+            tile_ids_.clear();
+        }
 
-//            printf("Animation block data: %c%c%c%c %c%c%c%c %d\n", VA_FCC(id), VA_FCC(type), size);
+          std::vector < pixel > data_;
+        vi2 size_;
+        bool has_alpha_;
+        tile_store *store_;
+        vi2 tiles_;
+        std::vector < u32 > tile_ids_;
+    };
 
-            size_t endpos = file_.get_pos() + size;
+    // state of one layer in one frame
+    struct animation {
+        animation():enabled(-1) {
+        }
 
-            if (size > 0)
-            {
-                u32 desc = file_.getu32();    //0x0010
-                parse_descriptor(0, 0, dest);
-            }
+        vi2 offs_;
+        int enabled;    // -1 until set, then resolved from the layer flags
+    };
 
-            file_.set_pos(endpos);
+    struct frame {
+        frame():delay_(0) {
         }
 
-        void parse_animation_block(layered_image & dest, u32 size) {
+        int delay_;
+          std::vector < animation > layers_;    // one per layer once loaded
+    };
 
-            size_t bstart = file_.get_pos();
-            size_t endpos = file_.get_pos() + size;
+    enum layer_coverage {
+        coverage_partial,
+        coverage_empty,    // no visible pixel
+        coverage_opaque,    // every pixel fully opaque
+    };
 
-            u32 id = file_.getu32();    //'mani'
-            u32 type = file_.getu32();    //'IRFR'
-            u32 bsize = file_.getu32();
+    enum layer_section {
+        section_none,
+        section_open_folder,
+        section_closed_folder,
+        section_divider,    // hidden record closing a group, below its children
+    };
+
+    struct layer {
+        layer():flags(0), opacity_(255), blend_mode_('norm'), section_(section_none), parent_(-1), culled_(false),
+            coverage_(coverage_partial) {
+        }
+
+        std::string name_;
+        vi2 offs_;
+        bitmap data_;
+        int flags;
+        u8 opacity_;
+        u32 blend_mode_;
+
+        // group tree from the 'lsct' section dividers
+        int section_;
+        int parent_;    // index of the enclosing group layer, -1 at the root
+        bool culled_;    // invisible in every frame, pixel data was not decoded
+
+        // set by analyze_layer()
+        vi2 bounds_offs_;    // tight alpha bounds, relative to offs_
+        vi2 bounds_size_;
+        int coverage_;
+    };
+
+    // bitmaps of a tiled document point into tiles_, so it must not be copied
+    struct layered_image {
+        vi2 size_;
+          std::vector < layer > layers_;
+          std::vector < frame > frames_;    // empty for a still image
+        tile_store tiles_;
+
+        // 1/2, 1/4, ... size copies of this document when load_options::mip_levels_
+        // is set; their tiled bitmaps share the tiles_ of this image
+          std::vector < layered_image > mips_;
+
+        bitmap composite_;    // merged image, only with load_options::composite_only_
+    };
+
+    struct load_stats {
+        load_stats():layers_(0), layers_decoded_(0), layers_culled_(0), frames_(0), channel_bytes_(0) {
+        }
+
+        u32 layers_;
+        u32 layers_decoded_;
+        u32 layers_culled_;
+        u32 frames_;
+        u64 channel_bytes_;    // compressed channel data that was decoded
+    };
+
+    inline void log_stdout(void *, const char *msg) {
+        fputs(msg, stdout);
+    }
+
+    struct load_options {
+        load_options():tile_budget_(0), cull_hidden_(true), mip_levels_(0), keep_full_(true), composite_only_(false),
+            composite_level_(0), log_(log_stdout), log_user_(0), stats_(0) {
+        }
+
+        size_t tile_budget_;    // bytes of resident tiles, 0 keeps layers dense
+        bool cull_hidden_;    // skip decoding layers that are never visible
+        u32 mip_levels_;    // halved copies built while decoding (no more than reach 1x1)
+        bool keep_full_;    // false leaves full resolution layers unallocated
+
+        // decode only the merged image into layered_image::composite_, halved
+        // composite_level_ times (at most down to one pixel); no layer is read
+        bool composite_only_;
+        u32 composite_level_;
+
+        // Loads share no mutable state, so documents can be loaded on many
+        // threads at once as long as each has its own sinks.
+        void (*log_) (void *user, const char *msg);    // null discards the log
+        void *log_user_;
+        load_stats *stats_;    // optional, filled in by the load
+    };
+
+    enum error_code {
+        error_code_no_error,
+        error_code_not_supported,
+        error_code_invalid_file,
+        error_code_write_failed,
+    };
+
+    // find the tight alpha bounds and coverage of a decoded layer
+    void analyze_layer(layer & l);
+
+    error_code load_layered_image(layered_image & dest, const char *fname);
+    error_code load_layered_image(layered_image & dest, const char *fname, const load_options & opts);
+
+    // see anim_bundle.h for the layout
+    error_code write_anim_bundle(const layered_image & src, const char *fname);
+
+    // a still image has a single frame
+    u32 get_frame_count(const layered_image & img);
+
+    // visibility of a layer combined with its enclosing groups
+    bool is_layer_visible(const layered_image & img, u32 frame, u32 index);
+
+    // layer opacity combined with its enclosing groups
+    u32 get_layer_opacity(const layered_image & img, u32 index);
+
+    // composite one frame into a canvas of img.size_ pixels (source over)
+    void compose_frame(const layered_image & img, u32 frame, std::vector < pixel > &dest);
+
+    // recomposite only region of a canvas already sized for img
+    void compose_region(const layered_image & img, u32 frame, std::vector < pixel > &dest, const recti & region);
+
+    // canvas rectangle a layer covers in a frame, false if it draws nothing
+    bool get_layer_rect(const layered_image & img, u32 frame, u32 index, recti & r);
+
+    // Random access frames for scrubbing. Frames on the keyframe interval are
+    // kept as snapshots once rendered, other frames in an LRU cache; both
+    // share the byte budget. A new frame starts from the cached frame with the
+    // smallest changed area and only the rectangles of layers whose
+    // visibility or offset differ are composited again.
+    struct frame_renderer {
+        frame_renderer(const layered_image & img, u32 keyframe_interval = 16, size_t budget = 256 << 20);
+
+        // valid until the next call
+        const std::vector < pixel > &render(u32 frame);
+
+        // rectangles of every layer whose visibility or position differs
+        // between two frames, merged where they overlap; outside of them the
+        // frames are identical. Returns the total area.
+        u64 get_dirty(u32 from, u32 to, std::vector < recti > &dirty) const;
+
+private:
+        struct cached_frame {
+            u32 frame_;
+            std::vector < pixel > pixels_;
+        };
+
+        size_t keyframe_bytes() const;
+        void trim();
+        static void add_dirty(std::vector < recti > &dirty, recti r);
+
+        void operator=(const frame_renderer &) {
+        };
+
+        const layered_image & img_;
+        u32 keyframe_interval_;
+        size_t budget_;
+        size_t bytes_;
+        std::map < u32, std::vector < pixel > >keyframes_;
+        std::list < cached_frame > recent_;
+    };
+
+    // One palette for a whole timeline. Frames are added in order with the
+    // rectangles that changed since the previous one (frame_renderer::get_dirty):
+    // only their pixels move between the bins of the current frame histogram,
+    // and a bin's total catches up with the frames it was unchanged for only
+    // when it changes again or the palette is built.
+    struct quantizer {
+        static const u32 BINS = 1 << 15;    // 5 bits per channel
+        static const u32 TRANSPARENT_BIN = BINS;    // alpha < 128
+
+        quantizer();
+
+        // changed is ignored for the first frame
+        void add_frame(const std::vector < pixel > &frame, int width, const std::vector < recti > &changed);
+
+        // median cut over the accumulated histogram, index 0 is transparent
+        // when any transparent pixel was seen
+        void build_palette(u32 colors);
+
+        // frame must have width * n pixels
+        void map_frame(const std::vector < pixel > &frame, int width, bool dither, std::vector < u8 > &dest);
+
+        const std::vector < pixel > &get_palette() const {
+            return palette_;
+        }
+
+private:
+        static u32 get_bin(const pixel & p) {
+            if (p.v[0] < 128)
+                return TRANSPARENT_BIN;
+            return ((p.v[1] >> 3) << 10) | ((p.v[2] >> 3) << 5) | (p.v[3] >> 3);
+        }
+
+        u8 nearest(u32 bin);
+        void flush_bin(u32 bin);
+        void move_pixel(u32 from, u32 to);
+
+        std::vector < u32 > frame_hist_;
+        std::vector < u32 > since_;    // frames_ when the bin was last added to total_
+        std::vector < u64 > total_;
+        u32 frames_;
+        std::vector < pixel > prev_;
+        std::vector < pixel > palette_;
+        std::vector < u16 > lut_;    // bin -> palette index, filled on demand
+        u32 first_color_;    // 1 when index 0 is the transparent entry
+    };
+
+    // FNV-1a over everything a load produces, pixels only inside the
+    // analysed bounds of each layer
+    u64 hash_layered_image(const layered_image & img);
+
+    // 32-bit BMP
+    error_code write_bmp(const char *fname, const bitmap & src);
+
+    // 8-bit indexed BMP, palette entries are written without alpha
+    error_code write_indexed_bmp(const char *fname, int width, int height, const std::vector < pixel > &palette,
+        const std::vector < u8 > &indices);
+}
+
+namespace psdlite {
+    // OR and AND of n pixels taken as 32-bit words
+    inline void or_and_pixels(const pixel * p, int n, u32 & any, u32 & all) {
+        int x = 0;
+        any = 0;
+        all = ~0u;
+#ifdef HAVE_SSE2
+        __m128i vany = _mm_setzero_si128();
+        __m128i vall = _mm_set1_epi32(-1);
+        for (; x + 4 <= n; x += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+            vany = _mm_or_si128(vany, v);
+            vall = _mm_and_si128(vall, v);
+        }
+
+        u32 lanes[8];
+        _mm_storeu_si128((__m128i *) lanes, vany);
+        _mm_storeu_si128((__m128i *) (lanes + 4), vall);
+        any = lanes[0] | lanes[1] | lanes[2] | lanes[3];
+        all = lanes[4] & lanes[5] & lanes[6] & lanes[7];
+#endif
+        for (; x != n; ++x)
+        {
+            u32 w;
+            memcpy(&w, &p[x], sizeof(w));
+            any |= w;
+            all &= w;
+        }
+    }
+
+    void analyze_layer(layer & l) {
+        vi2 s = l.data_.get_size();
+        l.bounds_offs_.set(0, 0);
+        l.bounds_size_ = s;
+
+        if (s.x <= 0 || s.y <= 0)
+        {
+            l.bounds_size_.set(0, 0);
+            l.coverage_ = coverage_empty;
+            return;
+        }
+
+        if (!l.data_.has_alpha())
+        {
+            l.coverage_ = coverage_opaque;
+            return;
+        }
+
+        // OR/AND every row as whole words and look at the alpha lane only,
+        // which keeps the inner loop free of branches and byte shuffles
+        u32 alpha_mask;
+        pixel mask(255, 0, 0, 0);
+        memcpy(&alpha_mask, &mask, sizeof(alpha_mask));
+
+        std::vector < pixel > row(s.x);
+        int x0 = s.x, x1 = -1, y0 = s.y, y1 = -1;
+        bool opaque = true;
+
+        for (int y = 0; y != s.y; ++y)
+        {
+            l.data_.get_row(y, &row[0]);
+
+            u32 any, all;
+            or_and_pixels(&row[0], s.x, any, all);
+
+            opaque &= (all & alpha_mask) == alpha_mask;
+            if (!(any & alpha_mask))
+                continue;
+
+            if (y0 > y)
+                y0 = y;
+            y1 = y;
+
+            // only widen the known columns
+            for (int x = 0; x < x0; ++x)
+                if (row[x].v[0])
+                {
+                    x0 = x;
+                    break;
+                }
+            for (int x = s.x - 1; x > x1; --x)
+                if (row[x].v[0])
+                {
+                    x1 = x;
+                    break;
+                }
+        }
+
+        if (y1 < 0)
+        {
+            l.bounds_size_.set(0, 0);
+            l.coverage_ = coverage_empty;
+            return;
+        }
+
+        l.bounds_offs_.set(x0, y0);
+        l.bounds_size_.set(x1 - x0 + 1, y1 - y0 + 1);
+        l.coverage_ = opaque ? coverage_opaque : coverage_partial;
+    }
+
+    inline vi2 mip_size(const vi2 & s, u32 level) {
+        long long d = 1LL << std::min(level, 32u);
+        return vi2((int)((s.x + d - 1) / d), (int)((s.y + d - 1) / d));
+    }
+
+    inline vi2 mip_offset(const vi2 & o, u32 level) {
+        // round towards negative infinity
+        long long d = 1LL << std::min(level, 32u);
+        return vi2((int)((o.x - (o.x < 0 ? d - 1 : 0)) / d), (int)((o.y - (o.y < 0 ? d - 1 : 0)) / d));
+    }
+
+    // halvings until the larger side is a single pixel
+    inline u32 max_mip_level(const vi2 & s) {
+        u32 level = 0;
+        for (int m = std::max(s.x, s.y); m > 1; m = (m + 1) / 2)
+            ++level;
+        return level;
+    }
+
+    // 2x2 box filter of two rows, an odd last column is averaged vertically
+    inline void reduce_rows(const u8 * a, const u8 * b, int width, u8 * dest) {
+        int pairs = width / 2;
+        int x = 0;
+#ifdef HAVE_SSE2
+        // 16 outputs at a time: even and odd bytes summed as 16-bit lanes
+        const __m128i lo = _mm_set1_epi16(0xff);
+        const __m128i two = _mm_set1_epi16(2);
+        for (; x + 16 <= pairs; x += 16)
+        {
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(a + 2 * x));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(a + 2 * x + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i *)(b + 2 * x));
+            __m128i b1 = _mm_loadu_si128((const __m128i *)(b + 2 * x + 16));
+
+            __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, lo), _mm_srli_epi16(a0, 8)),
+                _mm_add_epi16(_mm_and_si128(b0, lo), _mm_srli_epi16(b0, 8)));
+            __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, lo), _mm_srli_epi16(a1, 8)),
+                _mm_add_epi16(_mm_and_si128(b1, lo), _mm_srli_epi16(b1, 8)));
+
+            s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+            s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+            _mm_storeu_si128((__m128i *)(dest + x), _mm_packus_epi16(s0, s1));
+        }
+#endif
+        for (; x != pairs; ++x)
+            dest[x] = (u8) ((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+        if (width & 1)
+            dest[pairs] = (u8) ((a[width - 1] + b[width - 1] + 1) >> 1);
+    }
+
+    // 2x2 box filter of a colour channel weighted by the alpha rows wa, wb so
+    // the colour of transparent pixels does not bleed into visible ones; a
+    // fully transparent block gets the plain average
+    inline void reduce_rows_weighted(const u8 * a, const u8 * b, const u8 * wa, const u8 * wb, int width, u8 * dest) {
+        int pairs = width / 2;
+        for (int x = 0; x != pairs; ++x)
+        {
+            int i = 2 * x;
+            u32 w = wa[i] + wa[i + 1] + wb[i] + wb[i + 1];
+            if (!w)
+            {
+                dest[x] = (u8) ((a[i] + a[i + 1] + b[i] + b[i + 1] + 2) >> 2);
+                continue;
+            }
+            u32 sum = a[i] * wa[i] + a[i + 1] * wa[i + 1] + b[i] * wb[i] + b[i + 1] * wb[i + 1];
+            dest[x] = (u8) ((sum + w / 2) / w);
+        }
+
+        if (width & 1)
+        {
+            int i = width - 1;
+            u32 w = wa[i] + wb[i];
+            if (!w)
+                dest[pairs] = (u8) ((a[i] + b[i] + 1) >> 1);
+            else
+                dest[pairs] = (u8) ((a[i] * wa[i] + b[i] * wb[i] + w / 2) / w);
+        }
+    }
+
+    // Halves one channel into a chain of bitmaps as its rows are decoded, so
+    // the full resolution pixels are never read back. Alpha (channel 0) is
+    // expected first: its planes are kept at every level until clear_alpha()
+    // and the colour channels that follow are averaged weighted by them.
+    struct mip_builder {
+        mip_builder():record_alpha_(false), weighted_(false), alpha_width_(0) {
+        }
+
+        void begin(const std::vector < bitmap * > &levels, u32 channel, int width) {
+            levels_ = levels;
+            if (width <= 0)
+                levels_.clear();
+            channel_ = channel;
+            width_ = width;
+            pending_.resize(levels_.size());
+            reduced_.resize(levels_.size());
+            has_pending_.assign(levels_.size(), 0);
+            rows_.assign(levels_.size(), 0);
+
+            record_alpha_ = channel == 0 && !levels_.empty();
+            if (record_alpha_)
+            {
+                alpha_.assign(levels_.size() + 1, std::vector < u8 > ());
+                alpha_width_ = width;
+            }
+            weighted_ = channel != 0 && !alpha_.empty() && alpha_width_ == width;
+        }
+
+        // drop the alpha planes of the previous layer
+        void clear_alpha() {
+            alpha_.clear();
+        }
+
+        void add_row(const u8 * row) {
+            if (record_alpha_)
+                alpha_[0].insert(alpha_[0].end(), row, row + width_);
+            push(0, row, width_);
+        }
+
+        // an odd last row is paired with itself
+        void finish() {
+            int w = width_;
+            for (u32 l = 0; l != levels_.size(); ++l)
+            {
+                if (has_pending_[l])
+                    push(l, &pending_[l][0], w);
+                w = (w + 1) / 2;
+            }
+        }
+
+private:
+        void push(u32 l, const u8 * row, int w) {
+            for (; l != levels_.size(); ++l)
+            {
+                if (!has_pending_[l])
+                {
+                    pending_[l].assign(row, row + w);
+                    has_pending_[l] = 1;
+                    return;
+                }
+
+                has_pending_[l] = 0;
+                std::vector < u8 > &dest = reduced_[l];
+                dest.resize((w + 1) / 2);
+                // alpha of the same two rows, an odd last row is its own pair;
+                // missing alpha rows (a corrupt alpha channel) are not weighted
+                size_t y0 = (size_t) rows_[l] * 2 * w;
+                if (weighted_ && y0 + w <= alpha_[l].size())
+                {
+                    const u8 *a0 = &alpha_[l][0] + y0;
+                    const u8 *a1 = y0 + 2 * w <= alpha_[l].size() ? a0 + w : a0;
+                    reduce_rows_weighted(&pending_[l][0], row, a0, a1, w, &dest[0]);
+                }
+                else
+                    reduce_rows(&pending_[l][0], row, w, &dest[0]);
+                if (record_alpha_)
+                    alpha_[l + 1].insert(alpha_[l + 1].end(), dest.begin(), dest.end());
+                if (levels_[l])
+                    levels_[l]->set_channel_row(rows_[l], channel_, &dest[0]);
+                rows_[l]++;
+
+                row = &dest[0];
+                w = (int)dest.size();
+            }
+        }
+
+        std::vector < bitmap * >levels_;    // null levels are reduced but not kept
+        u32 channel_;
+        int width_;
+        std::vector < std::vector < u8 > >pending_;    // first row of a pair, per level
+        std::vector < std::vector < u8 > >reduced_;
+        std::vector < u8 > has_pending_;
+        std::vector < int >rows_;
+
+        bool record_alpha_;
+        bool weighted_;
+        int alpha_width_;
+        std::vector < std::vector < u8 > >alpha_;    // alpha planes, full size first
+    };
+
+    struct buffered_file {
+        // mapped where possible so sections that are skipped are never read
+        buffered_file(const char *fname):base_(0), size_(0), iter_(0), mapped_(false), error_(error_code_no_error) {
+#ifndef _WIN32
+            int fd = open(fname, O_RDONLY);
+            if (fd >= 0)
+            {
+                struct stat st;
+                if (!fstat(fd, &st) && st.st_size > 0)
+                {
+                    void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (p != MAP_FAILED)
+                    {
+                        base_ = (const s8 *)p;
+                        size_ = st.st_size;
+                        mapped_ = true;
+                    }
+                }
+                close(fd);
+                if (mapped_)
+                    return;
+            }
+#endif
+            FILE *f = fopen(fname, "rb");
+            if (!f)
+                  return;
+
+              fseek(f, 0, SEEK_END);
+              mem_.resize(ftell(f));
+              fseek(f, 0, SEEK_SET);
+              if (!mem_.empty())
+                  fread(&mem_[0], mem_.size(), 1, f);
+              fclose(f);
+
+              base_ = mem_.empty() ? 0 : &mem_[0];
+              size_ = mem_.size();
+        }
+
+        ~buffered_file() {
+#ifndef _WIN32
+            if (mapped_)
+                munmap((void *)base_, size_);
+#endif
+        } size_t get_pos() {
+            return iter_;
+        } void set_pos(size_t pos) {
+            if (pos > size_)
+                fail(error_code_invalid_file);
+            if (!failed())
+                iter_ = pos;
+        }
+
+        void pad_even() {
+            set_pos((iter_ + 1) & ~1);
+        }
+
+        // Errors are sticky instead of thrown: after the first one every read
+        // returns zero and the position stops moving, callers check failed()
+        // in their loops and unwind normally.
+        void fail(error_code e) {
+            if (!failed())
+                error_ = e;
+            iter_ = size_;
+        }
+
+        bool failed() const {
+            return error_ != error_code_no_error;
+        }
+
+        error_code get_error() const {
+            return error_;
+        }
+
+        u32 getKey() {
+            u32 len = getu32();
+            if (len == 0)
+                len = getu32();
+            else
+                skip(len);
+            return len;
+        }
+
+        s32 gets32() {
+            return (s32) getu32();
+        }
+
+        u32 getu32() {
+            if (!can_read(4))
+                return 0;
+
+            const u8 *p = (const u8 *) & base_[iter_];
+            iter_ += 4;
+            return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+
+        u16 getu16() {
+            if (!can_read(2))
+                return 0;
+
+            const u8 *p = (const u8 *) & base_[iter_];
+            iter_ += 2;
+            return (p[0] << 8) | p[1];
+        }
+
+        s16 gets16() {
+            return (s16) getu16();
+        }
+
+        u8 getu8() {
+            if (!can_read(1))
+                return 0;
+
+            const u8 *p = (const u8 *) & base_[iter_];
+            iter_ += 1;
+            return p[0];
+        }
+
+        s8 gets8() {
+            return (s8) getu8();
+        }
+
+        // null once failed
+        const u8 *get_bytes(u32 bytes) {
+            if (!can_read(bytes))
+                return 0;
+
+            const u8 *p = (const u8 *) & base_[iter_];
+            iter_ += bytes;
+            return p;
+        }
+
+        void skip(u32 bytes) {
+            if (can_read(bytes))
+                iter_ += bytes;
+        }
+
+        void skip_pstring() {
+            u8 s = getu8();
+            skip(s);
+            pad_even();
+        }
+
+        void skip_ustring() {
+            u32 s = getu32();
+            skip(s * 2);
+        }
+
+        int get_pstring(std::string & str) {
+            u8 s = getu8();
+            if (!can_read(s))
+                return s + 1;
+
+            iter_ += s;
+            str.assign(&base_[iter_ - s], &base_[iter_]);
+            pad_even();
+            return s + 1;
+        }
+
+        int getu32p(int ofs) {
+            const u8 *p = (const u8 *) & base_[iter_];
+            p += ofs;
+            return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+
+        void dumpHex(u32 bytes) {
+            for (int i = 0; i < bytes; i++)
+            {
+                unsigned char b = (unsigned char)base_[iter_ + i];
+                unsigned char c = b;
+                if (b < 32 || b > 128)
+                    c = ' ';
+                printf("%04d: %02x %c", i, b, c);
+                printf(i == (bytes - 1) ? "\n\n" : "\n");
+            }
+            iter_ += bytes;
+        }
+
+protected:
+        bool can_read(size_t bytes) {
+            if (!failed() && bytes <= size_ - iter_)
+                return true;
+            fail(error_code_invalid_file);
+            return false;
+        }
+
+        std::vector < s8 > mem_;    // when not mapped
+        const s8 *base_;
+        size_t size_;
+        size_t iter_;
+        bool mapped_;
+        error_code error_;
+
+private:
+        buffered_file(const buffered_file &);
+        void operator=(const buffered_file &);
+    };
+
+    /////////////////////////////////////////////////////////////
+
+    struct loader {
+        loader(buffered_file & file, const load_options & opts):file_(file), opts_(opts) {
+            m_layer = -1;
+            m_frame = -1;
+            m_state = -1;
+            m_section = section_none;
+            m_channels = 0;
+        } int m_layer;
+        int m_frame;    // index of the 'FrIn' entry being parsed, -1 outside
+        int m_state;    // position of the 'LaSt' entry being parsed, -1 outside
+
+        void next_layer() {
+            m_layer++;
+            m_state = -1;
+        }
+
+        // frames only come from the document 'FrIn' list
+        void next_frame(layered_image & dest) {
+            m_frame = (int)dest.frames_.size();
+            dest.frames_.push_back(frame());
+        }
+
+        void end_frame() {
+            m_frame = -1;
+        }
+
+        void set_frame_id(int id) {
+            LogDebug("frame %d, id: %d\n", m_frame, id);
+            if (m_frame >= 0)
+                m_frame_ids[id] = m_frame;
+        }
+
+        void set_frame_delay(layered_image & dest, int delay) {
+            LogDebug("frame %d, delay: %d\n", m_frame, delay);
+            if (m_frame >= 0)
+                dest.frames_[m_frame].delay_ = delay;
+        }
+
+        void next_state(int position) {
+            m_state = position;
+            m_state_value = animation();
+            m_state_frames.clear();
+        }
+
+        void set_layer_visible(layered_image & dest, int visible) {
+            LogDebug("layer: %d, state %d, visible: %d\n", m_layer, m_state, visible);
+            if (m_state >= 0)
+                m_state_value.enabled = visible;
+        }
+
+        void set_layer_dx(layered_image & dest, int dx) {
+            LogDebug("layer: %d, state %d, dx: %d\n", m_layer, m_state, dx);
+            if (m_state >= 0)
+                m_state_value.offs_.x = dx;
+        }
+
+        void set_frame_layer_dy(layered_image & dest, int dy) {
+            LogDebug("layer: %d, state %d, dy: %d\n", m_layer, m_state, dy);
+            if (m_state >= 0)
+                m_state_value.offs_.y = dy;
+        }
+
+        void add_state_frame(int id) {
+            LogDebug("layer: %d, state %d, frame id: %d\n", m_layer, m_state, id);
+            if (m_state >= 0)
+                m_state_frames.push_back(id);
+        }
+
+        // A state applies to the frames listed by id in its 'FrLs', or to the
+        // frame at its own position when it has no list. Unknown ids are
+        // dropped, states never add frames.
+        void end_state(layered_image & dest) {
+            if (m_state >= 0 && m_layer >= 0)
+            {
+                if (m_state_frames.empty())
+                    set_animation(dest, m_state);
+
+                for (u32 i = 0; i != m_state_frames.size(); ++i)
+                {
+                    std::map < int, int >::const_iterator it = m_frame_ids.find(m_state_frames[i]);
+                    if (it != m_frame_ids.end())
+                        set_animation(dest, it->second);
+                    else
+                        LogDebug("layer: %d, unknown frame id: %d\n", m_layer, m_state_frames[i]);
+                }
+            }
+            m_state = -1;
+        }
+
+        void log(const char *fmt, ...) {
+            if (!opts_.log_)
+                return;
+
+            char msg[1024];
+            va_list args;
+            va_start(args, fmt);
+            vsnprintf(msg, sizeof(msg), fmt, args);
+            va_end(args);
+            opts_.log_(opts_.log_user_, msg);
+        }
+
+        void set_animation(layered_image & dest, int f) {
+            if (f < 0 || f >= (int)dest.frames_.size())
+                return;
+
+            // frame states are parsed before their layer record is appended
+            u32 index = (u32) dest.layers_.size();
+            std::vector < animation > &states = dest.frames_[f].layers_;
+            if (states.size() <= index)
+                states.resize(index + 1);
+            states[index] = m_state_value;
+        }
+
+        // layers without a state in a frame keep their document visibility
+        void resolve_timeline(layered_image & dest) {
+            for (u32 f = 0; f != dest.frames_.size(); ++f)
+            {
+                std::vector < animation > &states = dest.frames_[f].layers_;
+                states.resize(dest.layers_.size());
+                for (u32 i = 0; i != states.size(); ++i)
+                    if (states[i].enabled < 0)
+                        states[i].enabled = !(dest.layers_[i].flags & 2);
+            }
+        }
+
+private:
+        buffered_file & file_;
+        const load_options & opts_;
+
+        u32 m_channels;
+
+        // 'FrID' to frame index, and the layer state being parsed
+        std::map < int, int >m_frame_ids;
+        animation m_state_value;
+        std::vector < int >m_state_frames;
+
+        // additional info of the record being parsed
+        int m_section;
+        u32 m_section_blend_mode;
+
+        struct channel_info {
+            s16 id_;
+            u32 bytes_;    // including the compression field
+        };
+
+        // layer sizes and channel data lengths, kept until pixel data
+        std::vector < vi2 > m_sizes;
+        std::vector < std::vector < channel_info > >m_channels_info;
+        std::vector < u64 > m_channel_bytes;
+
+        mip_builder m_mips;
+
+        void operator=(const loader &) {
+        };        // no assignement operator
+
+        void parse_header(layered_image & dest) {
+            u32 sig = file_.getu32();
+            (void)sig;
+
+            u16 ver = file_.getu16();
+            (void)ver;
+
+            file_.skip(6);
+
+            m_channels = file_.getu16();
+
+            u32 rows = file_.getu32();
+            u32 columns = file_.getu32();
+
+            // 30000 for PSD, 300000 for PSB
+            if (rows > 300000 || columns > 300000)
+            {
+                file_.fail(error_code_invalid_file);
+                return;
+            }
+
+            dest.size_.set(columns, rows);
+
+            u16 depth = file_.getu16();
+            if (depth != 8)
+            {
+                file_.fail(error_code_not_supported);    // only support 8bit depth
+                return;
+            }
+
+            u16 mode = file_.getu16();
+
+            if (mode != 3)
+            {
+                file_.fail(error_code_not_supported);    // only support RGB mode
+            }
+        }
+
+        void _skip_block() {
+            u32 size = file_.getu32();
+            file_.dumpHex(size);
+        }
+
+        void skip_block() {
+            u32 size = file_.getu32();
+            file_.skip(size);
+        }
+
+        void parse_animation_block_data(layered_image & dest) {
+
+            u32 id = file_.getu32();    //'8BIM'
+            u32 type = file_.getu32();    //'AnDs'
+            u32 size = file_.getu32();    //size
+
+//            printf("Animation block data: %c%c%c%c %c%c%c%c %d\n", VA_FCC(id), VA_FCC(type), size);
+
+            size_t endpos = file_.get_pos() + size;
+
+            if (size > 0)
+            {
+                u32 desc = file_.getu32();    //0x0010
+                parse_descriptor(0, 0, dest);
+            }
+
+            file_.set_pos(endpos);
+        }
+
+        void parse_animation_block(layered_image & dest, u32 size) {
+
+            size_t bstart = file_.get_pos();
+            size_t endpos = file_.get_pos() + size;
+
+            u32 id = file_.getu32();    //'mani'
+            u32 type = file_.getu32();    //'IRFR'
+            u32 bsize = file_.getu32();
+
+//            printf("Animation block: %c%c%c%c %c%c%c%c %d\n", VA_FCC(id), VA_FCC(type), bsize);
+
+            parse_animation_block_data(dest);
+
+            file_.set_pos(endpos);
+        }
+
+        void parse_animation_metadata(layered_image & dest) {
+            u32 size = file_.getu32();
+
+            size_t endpos = file_.get_pos() + size;
+
+            u32 desc = file_.getu32();
+            parse_descriptor(0, 0, dest);
+
+            file_.set_pos(endpos);
+        }
+
+
+        void parse_image_resources(layered_image & dest) {
+
+            u32 size = file_.getu32();
+            u32 endpos = file_.get_pos() + size;
+
+            while (file_.get_pos() < endpos && !file_.failed())
+            {
+                parse_image_resource_block(dest);
+            }
+
+        }
+
+        void parse_image_resource_block(layered_image & dest) {            
+
+            u32 block_type = file_.getu32();
+            (void)block_type;
+
+            u16 block_id = file_.getu16();
+            (void)block_id;
+
+            file_.skip_pstring();
+
+            u32 size = file_.getu32();
+
+            size_t endpos = file_.get_pos() + size;
+
+//            LogDebug("Image resource block: %c%c%c%c, %04d, %d bytes\n", VA_FCC(block_type), block_id, size);
+
+            switch (block_id)
+            {
+                case 4000: case 4004:
+                    parse_animation_block(dest, size);
+                    break;
+                    
+                default:                
+                    file_.skip(size);
+                    break;
+            }
+
+            file_.pad_even();
+        }
+
+        void emit_row(bitmap & dest, int y, int color_channel, const u8 * row) {
+            dest.set_channel_row(y, color_channel, row);
+            m_mips.add_row(row);
+        }
+
+        void parseRAWChannel(bitmap & dest, const vi2 & s, int color_channel) {
+            for (int y = 0; y != s.y; ++y)
+            {
+                const u8 *row = file_.get_bytes(s.x);
+                if (!row)
+                    return;
+                emit_row(dest, y, color_channel, row);
+            }
+        }
+
+        void parseRLEChannel(bitmap & dest, const vi2 & s, int color_channel) {
+            // RLE compression...
+            std::vector < u16 > scanline_byte_counts(s.y);
+
+            // get bytecounts for all scanlines
+            for (int y = 0; y != s.y; ++y)
+            {
+                scanline_byte_counts[y] = file_.getu16();
+            }
+
+            if (s.y)
+                parse_rle_rows(dest, s, color_channel, &scanline_byte_counts[0]);
+        }
+
+        void parse_rle_rows(bitmap & dest, const vi2 & s, int color_channel, const u16 * scanline_byte_counts) {
+            // a run may overshoot the row by up to 128 bytes
+            std::vector < u8 > line(s.x + 128);
+
+            for (int y = 0; y != s.y && !file_.failed(); ++y)
+            {
+                int line_bytes = scanline_byte_counts[y];
+                std::fill(line.begin(), line.end(), pixel().v[color_channel]);
+
+                for (int x = 0; line_bytes && (x < s.x);)
+                {
+                    int control_byte = file_.gets8();
+                    --line_bytes;
+                    if (control_byte < 0)
+                    {
+                        int count = 1 - control_byte;
+
+                        // RLE
+                        if (line_bytes)
+                        {
+                            u8 v = file_.getu8();
+                            --line_bytes;
+
+                            for (; count; --count, ++x)
+                                line[x] = v;
+                        }
+                    }
+                    else
+                    {
+                        int count = 1 + control_byte;
+
+                        // RAW
+                        for (; count && line_bytes; --line_bytes, --count, ++x)
+                            line[x] = file_.getu8();
+                    }
+                }
+
+                emit_row(dest, y, color_channel, &line[0]);
+            }
+        }
+
+        // dest may be left unallocated when only mips are kept
+        void parse_layer_channel_data(bitmap & dest, const vi2 & s, const std::vector < channel_info > &channels,
+            const std::vector < bitmap * > &mips) {
+            // channels are located by their lengths so alpha can be decoded
+            // first, the mips weight colour by it
+            std::vector < size_t > starts(channels.size() + 1, file_.get_pos());
+            std::vector < u32 > order;
+            for (u32 i = 0; i != channels.size(); ++i)
+            {
+                starts[i + 1] = starts[i] + channels[i].bytes_;
+
+                // -1 is alpha, 0..2 RGB; masks (-2, -3) have their own rectangle
+                int id = channels[i].id_;
+                if (id == -1)
+                    order.insert(order.begin(), i);
+                else if (id >= 0 && id <= 2)
+                    order.push_back(i);
+            }
+
+            m_mips.clear_alpha();
+            for (u32 k = 0; k != order.size() && !file_.failed(); ++k)
+            {
+                u32 i = order[k];
+                int color_channel = channels[i].id_ + 1;
+
+                file_.set_pos(starts[i]);
+                u16 compression = file_.getu16();
+
+                m_mips.begin(mips, color_channel, s.x);
+
+                switch (compression)
+                {
+                    case 0:    // raw data
+                        parseRAWChannel(dest, s, color_channel);
+                        break;
+                    case 1:    // rle.. good
+                        parseRLEChannel(dest, s, color_channel);
+                        break;
+                    case 2:
+                    case 3:
+                        file_.fail(error_code_not_supported);
+                        break;
+                }
+
+                m_mips.finish();
+            }
+
+            file_.set_pos(starts.back());
+        }
+
+        static const u32 MAX_DESCRIPTOR_DEPTH = 64;
+
+        void parse_descriptor(u32 lvl, u32 node, layered_image & dest) {
+
+            file_.skip_ustring();
+
+            u32 size = file_.getu32();
+            u32 id = file_.getu32();
+            u32 items = file_.getu32();
+
+            for (u32 i = 0; i < items && !file_.failed(); i++)
+            {
+                u32 key = file_.getKey();
+                u32 type = file_.getu32();
+                parse_type(lvl, i, node, key, type, dest);
+            }
+        }
+
+        void parse_object_list(u32 lvl, u32 node, layered_image & dest) {
+            u32 items = file_.getu32();
+            for (u32 i = 0; i < items && !file_.failed(); i++)
+            {
+                u32 type = file_.getu32();
+                parse_type(lvl, i, node, 'VlLs', type, dest);
+            }
+        }
+
+        void parse_type(u32 lvl, u32 idx, u32 node, u32 id, u32 type, layered_image & dest) {
+
+            // descriptors and lists nest, bound the recursion on corrupt files
+            if (lvl > MAX_DESCRIPTOR_DEPTH)
+            {
+                file_.fail(error_code_invalid_file);
+                return;
+            }
+
+            LogParse("%s%c%c%c%c:%c%c%c%c\n", indent(lvl).c_str(), VA_FCC(id), VA_FCC(type));
+
+            u8 vbool = 0;
+            s32 vlong = 0;
+            double vdouble = 0;
+
+            if (id == 'LaID')
+                next_layer();
+
+            if (id == 'VlLs' && node == 'FrIn')
+                next_frame(dest);
+
+            if (id == 'VlLs' && node == 'LaSt')
+                next_state(idx);
+
+            switch (type)
+            {
+                case 'VlLs':
+                    parse_object_list(lvl + 1, id, dest);
+                    break;
+
+                case 'Objc':
+                case 'GLbO':
+                    parse_descriptor(lvl + 1, id, dest);
+                    break;
+
+                case 'bool':
+                    vbool = file_.getu8();
+                    LogParse("%s%d\n", indent(lvl + 1).c_str(), vbool);
+                    break;
+
+                case 'long':
+                    vlong = file_.gets32();
+                    LogParse("%s%d\n", indent(lvl + 1).c_str(), vlong);
+                    break;
+
+                case 'doub':
+                    vdouble = (double)file_.gets32();
+                    file_.gets32();
+                    LogParse("%s%f\n", indent(lvl + 1).c_str(), vdouble);
+                    break;
+
+                case 'UntF':
+                    file_.gets32();
+                    file_.gets32();
+                    file_.gets32();
+                    break;
+
+                case 'TEXT':
+                    file_.skip_ustring();
+                    break;
+
+                default:
+                    file_.gets32();
+                    break;
+            }
+
+            if (id == 'FrID')
+            {
+                set_frame_id(vlong);
+            }
+
+            if (id == 'FrDl')
+            {
+                set_frame_delay(dest, vlong);
+            }
+
+            if (id == 'VlLs' && node == 'FrLs')
+            {
+                add_state_frame(vlong);
+            }
+
+            if (id == 'enab')
+            {
+                set_layer_visible(dest, vbool);
+            }
+
+            if (node == 'Ofst')
+            {
+                if (id == 'Hrzn')
+                    set_layer_dx(dest, vlong);
+                if (id == 'Vrtc')
+                    set_frame_layer_dy(dest, vlong);
+            }
+
+            if (id == 'VlLs' && node == 'FrIn')
+                end_frame();
+
+            if (id == 'VlLs' && node == 'LaSt')
+                end_state(dest);
+        }
+
+        void parse_metadata(layered_image & dest) {
+            u32 size = file_.getu32();
+            u32 items = file_.getu32();
+
+            for (u32 i = 0; i < items && !file_.failed(); i++)
+            {
+                u32 sig = file_.getu32();
+                u32 key = file_.getu32();
+                u32 unk = file_.getu32();
+
+                switch (key)
+                {
+                    case 'mlst':
+                        parse_animation_metadata(dest);
+                        break;
+                    default:
+                        skip_block();
+                        break;
+                }
+            }
+        }
+
+        void parse_section_divider() {
+            u32 size = file_.getu32();
+            size_t endpos = file_.get_pos() + size;
+
+            m_section = file_.getu32();
+            if (size >= 12)
+            {
+                file_.getu32();    // '8BIM'
+                m_section_blend_mode = file_.getu32();
+            }
+
+            file_.set_pos(endpos);
+        }
+
+        void parse_layer_addinfo(layered_image & dest) {
+            u32 sig = file_.getu32();
+            u32 key = file_.getu32();
+
+            switch (key)
+            {
+                case 'shmd':
+                    parse_metadata(dest);
+                    break;
+
+                case 'lsct':
+                case 'lsdk':
+                    parse_section_divider();
+                    break;
+
+                default:
+                    skip_block();
+                    break;
+            }
+        }
+
+        void parse_layer_pixel_data(layered_image & dest) {
+            for (u32 i = 0; i != dest.layers_.size() && !file_.failed(); ++i)
+            {
+                layer & l = dest.layers_[i];
+                if (l.culled_)
+                {
+                    LogDebug("layer: %d, culled\n", i);
+                    file_.skip((u32) m_channel_bytes[i]);
+                    if (opts_.stats_)
+                        opts_.stats_->layers_culled_++;
+                }
+                else
+                {
+                    if (opts_.stats_)
+                    {
+                        opts_.stats_->layers_decoded_++;
+                        opts_.stats_->channel_bytes_ += m_channel_bytes[i];
+                    }
+
+                    std::vector < bitmap * >mips;
+                    for (u32 k = 0; k != dest.mips_.size(); ++k)
+                    {
+                        bitmap & m = dest.mips_[k].layers_[i].data_;
+                        vi2 s = mip_size(m_sizes[i], k + 1);
+                        m.resize(s.x, s.y);
+                        mips.push_back(&m);
+                    }
+
+                    if (opts_.keep_full_)
+                        l.data_.resize(m_sizes[i].x, m_sizes[i].y);
+                    parse_layer_channel_data(l.data_, m_sizes[i], m_channels_info[i], mips);
+
+                    l.data_.compact();
+                    for (u32 k = 0; k != mips.size(); ++k)
+                        mips[k]->compact();
+                }
+
+                analyze_layer(l);
+                for (u32 k = 0; k != dest.mips_.size(); ++k)
+                    analyze_layer(dest.mips_[k].layers_[i]);
+            }
+        }
+
+        void parse_layer_record(layered_image & dest) {
+            u32 top = file_.getu32();
+            u32 left = file_.getu32();
+            u32 bottom = file_.getu32();
+            u32 right = file_.getu32();
+
+            u16 channel_count = file_.getu16();
+            u64 channel_bytes = 0;
+            std::vector < channel_info > channels(channel_count);
+            bool has_alpha = false;
+            for (u32 i = 0; i != channel_count; ++i)
+            {
+                channels[i].id_ = file_.gets16();
+                channels[i].bytes_ = file_.getu32();
+                channel_bytes += channels[i].bytes_;
+                has_alpha |= channels[i].id_ == -1;
+            }
+
+            u32 blend_mode_sig = file_.getu32();
+            (void)blend_mode_sig;
+
+            u32 blend_mode_key = file_.getu32();
+            (void)blend_mode_key;
+
+            u8 opacity = file_.getu8();
+            (void)opacity;
+
+            u8 clipping = file_.getu8();
+            (void)clipping;
+
+            u8 flags = file_.getu8();
+            (void)flags;
+
+            u8 filler = file_.getu8();
+            (void)filler;
+
+            u32 extra_size = file_.getu32();
+            size_t endpos = file_.get_pos() + extra_size;
+
+            if ((s32) right < (s32) left || (s32) bottom < (s32) top)
+            {
+                file_.fail(error_code_invalid_file);
+                return;
+            }
+
+            m_section = section_none;
+            m_section_blend_mode = blend_mode_key;
+
+            skip_block();    // layer mask adjustment data
+            skip_block();    // layer blending ranges
+
+            // "Pascal string, padded to a multiple of 4 bytes"
+            size_t p0 = file_.get_pos();
+            std::string l_name;
+            int len = file_.get_pstring(l_name);
+            len = round_int(len, 4);
+            file_.set_pos(p0 + len);
+
+            while (file_.get_pos() < endpos && !file_.failed())
+                parse_layer_addinfo(dest);
+
+            file_.set_pos(endpos);
+
+            // add layer to dest
+            dest.layers_.push_back(layer());
+            layer & l = dest.layers_.back();
+            l.name_ = l_name;
+            l.offs_.set(left, top);
+            if (dest.tiles_.enabled())
+                l.data_.set_tile_store(&dest.tiles_);
+            l.data_.set_has_alpha(has_alpha);
+            m_sizes.push_back(vi2(right - left, bottom - top));
+            m_channels_info.push_back(channels);
+            m_channel_bytes.push_back(channel_bytes);
+
+            l.flags = flags;
+            l.opacity_ = opacity;
+            l.blend_mode_ = blend_mode_key;
+            l.section_ = m_section;
+            if (m_section == section_open_folder || m_section == section_closed_folder)
+                l.blend_mode_ = m_section_blend_mode;
+        }
+
+        // Records are stored bottom up, so a group's divider comes before its
+        // children and the folder record itself after them.
+        void build_groups(layered_image & dest) {
+            std::vector < int > groups;
+            for (int i = (int)dest.layers_.size() - 1; i >= 0; --i)
+            {
+                layer & l = dest.layers_[i];
+                l.parent_ = groups.empty() ? -1 : groups.back();
+
+                if (l.section_ == section_open_folder || l.section_ == section_closed_folder)
+                    groups.push_back(i);
+                else if (l.section_ == section_divider && !groups.empty())
+                    groups.pop_back();
+            }
+        }
+
+        void cull_layers(layered_image & dest) {
+            if (!opts_.cull_hidden_)
+                return;
+
+            u32 fc = get_frame_count(dest);
+            for (u32 i = 0; i != dest.layers_.size(); ++i)
+            {
+                bool visible = false;
+                for (u32 f = 0; !visible && f != fc; ++f)
+                    visible = is_layer_visible(dest, f, i);
+
+                dest.layers_[i].culled_ = !visible || !get_layer_opacity(dest, i);
+            }
+        }
+
+        // each level is a complete document at reduced size sharing the tile
+        // store of dest; box filtering is aligned to every layer's origin
+        void prepare_mips(layered_image & dest) {
+            dest.mips_.resize(std::min(opts_.mip_levels_, max_mip_level(dest.size_)));
+            for (u32 k = 0; k != dest.mips_.size(); ++k)
+            {
+                layered_image & m = dest.mips_[k];
+                u32 level = k + 1;
+                m.size_ = mip_size(dest.size_, level);
+                m.layers_ = dest.layers_;
+                m.frames_ = dest.frames_;
+
+                for (u32 i = 0; i != m.layers_.size(); ++i)
+                    m.layers_[i].offs_ = mip_offset(dest.layers_[i].offs_, level);
+
+                // deltas from the rounded origin to the rounded frame position,
+                // rounding them separately would jitter by a pixel
+                for (u32 f = 0; f != m.frames_.size(); ++f)
+                {
+                    for (u32 i = 0; i != m.frames_[f].layers_.size(); ++i)
+                    {
+                        vi2 o = dest.layers_[i].offs_;
+                        vi2 d = dest.frames_[f].layers_[i].offs_;
+                        vi2 p = mip_offset(vi2(o.x + d.x, o.y + d.y), level);
+                        m.frames_[f].layers_[i].offs_.set(p.x - m.layers_[i].offs_.x, p.y - m.layers_[i].offs_.y);
+                    }
+                }
+            }
+        }
+
+        void parse_layer_structure(layered_image & dest) {
+            s16 l_count = (s16) abs(file_.gets16());
+
+            for (int i = 0; i != l_count && !file_.failed(); ++i)
+                parse_layer_record(dest);
+
+            file_.pad_even();
+        }
 
-//            printf("Animation block: %c%c%c%c %c%c%c%c %d\n", VA_FCC(id), VA_FCC(type), bsize);
+        void parse_layer_info(layered_image & dest) {
+            u32 size = file_.getu32();
 
-            parse_animation_block_data(dest);
+            size_t endpos = file_.get_pos() + size;
+
+            parse_layer_structure(dest);
+            if (file_.failed())
+                return;
+
+            resolve_timeline(dest);
+            build_groups(dest);
+            cull_layers(dest);
+            prepare_mips(dest);
+            parse_layer_pixel_data(dest);
 
             file_.set_pos(endpos);
         }
 
-        void parse_animation_metadata(layered_image & dest) {
+        void parse_layer_and_mask(layered_image & dest) {
             u32 size = file_.getu32();
-
             size_t endpos = file_.get_pos() + size;
 
-            u32 desc = file_.getu32();
-            parse_descriptor(0, 0, dest);
+            parse_layer_info(dest);
+            skip_block();    // parse_mask_info( dest, ptr, stop );
 
             file_.set_pos(endpos);
         }
 
+        // The merged image: channel planes in RGB(A) order, RLE byte counts for
+        // every row of every channel come first.
+        void parse_composite_image(layered_image & dest) {
+            vi2 s = dest.size_;
+            u32 level = std::min(opts_.composite_level_, max_mip_level(s));
+            u32 cc = m_channels < pixel::CHANNELS ? m_channels : pixel::CHANNELS;
 
-        void parse_image_resources(layered_image & dest) {
+            u16 compression = file_.getu16();
+            if (compression > 1)
+            {
+                file_.fail(error_code_not_supported);
+                return;
+            }
 
-            u32 size = file_.getu32();
-            u32 endpos = file_.get_pos() + size;
+            // the byte counts are read in place, so a truncated file fails
+            // here before anything is sized from the header
+            std::vector < u16 > scanline_byte_counts;
+            if (compression == 1)
+            {
+                u32 count = m_channels * (u32) s.y;
+                const u8 *p = file_.get_bytes(count * 2);
+                if (!p)
+                    return;
+
+                scanline_byte_counts.resize(count);
+                for (u32 i = 0; i != count; ++i)
+                    scanline_byte_counts[i] = (p[i * 2] << 8) | p[i * 2 + 1];
+            }
+
+            if (file_.failed())
+                return;
 
-            while (file_.get_pos() < endpos)
+            vi2 cs = mip_size(s, level);
+            dest.composite_.set_has_alpha(cc == pixel::CHANNELS);
+            dest.composite_.resize(cs.x, cs.y);
+
+            // reduced straight into the composite, skipping the levels between
+            bitmap full;
+            std::vector < bitmap * >levels(level, (bitmap *) 0);
+            if (level)
+                levels.back() = &dest.composite_;
+            bitmap & rows = level ? full : dest.composite_;
+
+            // planes are stored RGB then alpha, alpha is decoded first for the
+            // weighted mips
+            std::vector < size_t > starts(cc + 1, file_.get_pos());
+            for (u32 channel = 0; channel != cc; ++channel)
             {
-                parse_image_resource_block(dest);
+                size_t bytes = (size_t) s.x * s.y;
+                if (compression == 1)
+                {
+                    bytes = 0;
+                    for (int y = 0; y != s.y; ++y)
+                        bytes += scanline_byte_counts[channel * s.y + y];
+                }
+                starts[channel + 1] = starts[channel] + bytes;
+            }
+
+            m_mips.clear_alpha();
+            for (u32 k = 0; k != cc && !file_.failed(); ++k)
+            {
+                u32 channel = cc == pixel::CHANNELS ? (k + 3) % 4 : k;
+                int color_channel = channel < 3 ? channel + 1 : 0;
+
+                file_.set_pos(starts[channel]);
+                m_mips.begin(levels, color_channel, s.x);
+                if (compression == 0)
+                    parseRAWChannel(rows, s, color_channel);
+                else if (s.y)
+                    parse_rle_rows(rows, s, color_channel, &scanline_byte_counts[channel * s.y]);
+                m_mips.finish();
             }
 
+            file_.set_pos(starts.back());
         }
 
-        void parse_image_resource_block(layered_image & dest) {            
+public:
+        void parse_layered_image(layered_image & dest) {
+            parse_header(dest);
+            if (file_.failed())
+                return;
 
-            u32 block_type = file_.getu32();
-            (void)block_type;
+            skip_block();    //parse_color_data( dest );
+            parse_image_resources(dest);
 
-            u16 block_id = file_.getu16();
-            (void)block_id;
+            if (opts_.composite_only_)
+            {
+                skip_block();    // layer and mask information
+                parse_composite_image(dest);
+            }
+            else
+            {
+                parse_layer_and_mask(dest);
+                // skip composite image...
+            }
 
-            file_.skip_pstring();
+            if (opts_.stats_)
+            {
+                opts_.stats_->layers_ = (u32) dest.layers_.size();
+                opts_.stats_->frames_ = (u32) dest.frames_.size();
+            }
+        }
+    };
 
-            u32 size = file_.getu32();
+    error_code load_layered_image(layered_image & dest, const char *fname) {
+        return load_layered_image(dest, fname, load_options());
+    }
 
-            size_t endpos = file_.get_pos() + size;
+    error_code load_layered_image(layered_image & dest, const char *fname, const load_options & opts) {
+        try
+        {
+            // clear dest
+            dest.layers_.clear();
+            dest.frames_.clear();
+            dest.mips_.clear();
+            dest.composite_.resize(0, 0);
+            dest.size_.set(0, 0);
+            dest.tiles_.clear();
+            dest.tiles_.set_budget(opts.tile_budget_);
 
-//            LogDebug("Image resource block: %c%c%c%c, %04d, %d bytes\n", VA_FCC(block_type), block_id, size);
+            // load file
+            buffered_file file(fname);
 
-            switch (block_id)
+            loader l(file, opts);
+            l.parse_layered_image(dest);
+            return file.get_error();
+        }
+        catch(...)
+        {
+            // allocations sized from a corrupt file
+            return error_code_invalid_file;
+        }
+    }
+
+    // little-endian writer, the output counterpart of buffered_file
+    struct output_file {
+        output_file(const char *fname):pos_(0) {
+            f_ = fopen(fname, "wb");
+        }
+
+        ~output_file() {
+            if (f_)
+                fclose(f_);
+        }
+
+        bool is_open() const {
+            return f_ != 0;
+        }
+
+        bool close() {
+            bool ok = f_ && !ferror(f_);
+            if (f_ && fclose(f_))
+                ok = false;
+            f_ = 0;
+            return ok;
+        }
+
+        u64 get_pos() const {
+            return pos_;
+        }
+
+        void put(const void *data, size_t bytes) {
+            fwrite(data, bytes, 1, f_);
+            pos_ += bytes;
+        }
+
+        void putu16(u16 v) {
+            u8 b[2] = { (u8) v, (u8) (v >> 8) };
+            put(b, 2);
+        }
+
+        void putu32(u32 v) {
+            u8 b[4] = { (u8) v, (u8) (v >> 8), (u8) (v >> 16), (u8) (v >> 24) };
+            put(b, 4);
+        }
+
+        void puts32(s32 v) {
+            putu32((u32) v);
+        }
+
+        void putu64(u64 v) {
+            putu32((u32) v);
+            putu32((u32) (v >> 32));
+        }
+
+        void pad_to(u64 pos) {
+            static const u8 zero[ANIM_BUNDLE_ALIGN] = { 0 };
+            while (pos_ < pos)
+                put(zero, (size_t)std::min < u64 > (pos - pos_, sizeof(zero)));
+        }
+
+private:
+        void operator=(const output_file &) {
+        };
+
+        FILE *f_;
+        u64 pos_;
+    };
+
+    inline u64 align_bundle_offset(u64 ofs) {
+        return (ofs + ANIM_BUNDLE_ALIGN - 1) & ~(u64) (ANIM_BUNDLE_ALIGN - 1);
+    }
+
+    error_code write_anim_bundle(const layered_image & src, const char *fname) {
+        u32 lc = (u32) src.layers_.size();
+        u32 fc = src.frames_.empty() ? 1 : (u32) src.frames_.size();
+
+        u32 layer_table = sizeof(anim_bundle_header);
+        u32 frame_table = layer_table + lc * sizeof(anim_bundle_layer);
+        u32 state_table = frame_table + fc * sizeof(anim_bundle_frame);
+        u32 name_table = state_table + fc * lc * sizeof(anim_bundle_state);
+
+        // lay out names and pixel payloads
+        std::vector < u32 > names(lc);
+        std::vector < u64 > pixels(lc);
+        u64 ofs = name_table;
+        for (u32 i = 0; i != lc; ++i)
+        {
+            names[i] = (u32) ofs;
+            ofs += src.layers_[i].name_.size() + 1;
+        }
+        for (u32 i = 0; i != lc; ++i)
+        {
+            vi2 s = src.layers_[i].bounds_size_;
+            if (s.x > 0 && s.y > 0)
             {
-                case 4000: case 4004:
-                    parse_animation_block(dest, size);
-                    break;
-                    
-                default:                
-                    file_.skip(size);
-                    break;
+                ofs = pixels[i] = align_bundle_offset(ofs);
+                ofs += (u64) s.x * s.y * 4;
             }
+        }
+        u64 file_size = ofs;
+
+        output_file out(fname);
+        if (!out.is_open())
+            return error_code_write_failed;
+
+        out.putu32(ANIM_BUNDLE_MAGIC);
+        out.putu16(ANIM_BUNDLE_VERSION);
+        out.putu16(sizeof(anim_bundle_header));
+        out.putu32(src.size_.x);
+        out.putu32(src.size_.y);
+        out.putu32(lc);
+        out.putu32(fc);
+        out.putu32(layer_table);
+        out.putu32(frame_table);
+        out.putu32(state_table);
+        out.putu32(name_table);
+        out.putu64(file_size);
+        out.pad_to(layer_table);
+
+        for (u32 i = 0; i != lc; ++i)
+        {
+            const layer & l = src.layers_[i];
+            vi2 s = l.bounds_size_;
+            u32 flags = 0;
+            if (l.flags & 2)
+                flags |= ANIM_BUNDLE_LAYER_HIDDEN;
+            if (l.coverage_ == coverage_opaque)
+                flags |= ANIM_BUNDLE_LAYER_OPAQUE;
+            out.puts32(l.offs_.x + l.bounds_offs_.x);
+            out.puts32(l.offs_.y + l.bounds_offs_.y);
+            out.putu32(pixels[i] ? s.x : 0);
+            out.putu32(pixels[i] ? s.y : 0);
+            out.putu32(flags);
+            out.putu32(names[i]);
+            out.putu64(pixels[i]);
+            out.putu32(get_layer_opacity(src, i));
+            out.putu32(l.blend_mode_);
+        }
 
-            file_.pad_even();
+        for (u32 f = 0; f != fc; ++f)
+        {
+            out.putu32(src.frames_.empty() ? 0 : src.frames_[f].delay_);
+            out.putu32(0);
+        }
+
+        for (u32 f = 0; f != fc; ++f)
+        {
+            for (u32 i = 0; i != lc; ++i)
+            {
+                if (src.frames_.empty())
+                {
+                    out.putu32(0);
+                    out.putu32(0);
+                    out.putu32(is_layer_visible(src, f, i));
+                    continue;
+                }
+
+                const animation & a = src.frames_[f].layers_[i];
+                out.puts32(a.offs_.x);
+                out.puts32(a.offs_.y);
+                out.putu32(is_layer_visible(src, f, i));
+            }
         }
 
-        void parseRAWChannel(bitmap & dest, int color_channel) {
-            vi2 s = dest.get_size();
+        for (u32 i = 0; i != lc; ++i)
+            out.put(src.layers_[i].name_.c_str(), src.layers_[i].name_.size() + 1);
 
+        std::vector < pixel > row;
+        std::vector < u8 > bgra;
+        for (u32 i = 0; i != lc; ++i)
+        {
+            if (!pixels[i])
+                continue;
+
+            const layer & l = src.layers_[i];
+            const bitmap & b = l.data_;
+            vi2 o = l.bounds_offs_;
+            vi2 s = l.bounds_size_;
+            bool has_alpha = b.has_alpha();
+            row.resize(b.get_size().x);
+            bgra.resize(s.x * 4);
+
+            out.pad_to(pixels[i]);
             for (int y = 0; y != s.y; ++y)
             {
+                b.get_row(o.y + y, &row[0]);
                 for (int x = 0; x != s.x; ++x)
                 {
-                    u8 v = file_.getu8();
-                    dest.set_single_channel(x, y, color_channel, v);
+                    pixel & p = row[o.x + x];
+                    bgra[x * 4 + 0] = p.b();
+                    bgra[x * 4 + 1] = p.g();
+                    bgra[x * 4 + 2] = p.r();
+                    bgra[x * 4 + 3] = has_alpha ? p.a() : 255;
                 }
+                out.put(&bgra[0], bgra.size());
             }
         }
 
-        void parseRLEChannel(bitmap & dest, int color_channel) {
-            // RLE compression...
-            vi2 s = dest.get_size();
+        if (!out.close() || out.get_pos() != file_size)
+            return error_code_write_failed;
 
-            std::vector < u16 > scanline_byte_counts(s.y);
+        return error_code_no_error;
+    }
 
-            // get bytecounts for all scanlines
-            for (int y = 0; y != s.y; ++y)
+    u32 get_frame_count(const layered_image & img) {
+        return img.frames_.empty() ? 1 : (u32) img.frames_.size();
+    }
+
+    bool is_layer_visible(const layered_image & img, u32 frame, u32 index) {
+        for (int i = (int)index; i >= 0; i = img.layers_[i].parent_)
+        {
+            bool visible = !(img.layers_[i].flags & 2);
+            if (frame < img.frames_.size())
+                visible = img.frames_[frame].layers_[i].enabled != 0;
+            if (!visible)
+                return false;
+        }
+        return true;
+    }
+
+    // blend modes other than normal are composited as normal, groups
+    // pass their opacity down to their children
+    u32 get_layer_opacity(const layered_image & img, u32 index) {
+        u32 opacity = 255;
+        for (int i = (int)index; i >= 0; i = img.layers_[i].parent_)
+            opacity = (opacity * img.layers_[i].opacity_ + 127) / 255;
+        return opacity;
+    }
+
+    inline void blend_row(pixel * dst, const pixel * src, int n, u32 opacity, bool has_alpha) {
+        for (int x = 0; x != n; ++x)
+        {
+            u32 sa = has_alpha ? src[x].v[0] : 255;
+            sa = (sa * opacity + 127) / 255;
+            if (!sa)
+                continue;
+
+            pixel & d = dst[x];
+            if (sa == 255)
             {
-                scanline_byte_counts[y] = file_.getu16();
+                d = src[x];
+                d.v[0] = 255;
+                continue;
             }
 
-            for (int y = 0; y != s.y; ++y)
-            {
-                int line_bytes = scanline_byte_counts[y];
-                for (int x = 0; line_bytes && (x < s.x);)
-                {
-                    int control_byte = file_.gets8();
-                    --line_bytes;
-                    if (control_byte < 0)
-                    {
-                        int count = 1 - control_byte;
+            u32 dw = d.v[0] * (255 - sa) / 255;
+            u32 oa = sa + dw;
+            for (u32 c = 1; c != pixel::CHANNELS; ++c)
+                d.v[c] = (u8) ((src[x].v[c] * sa + d.v[c] * dw + oa / 2) / oa);
+            d.v[0] = (u8) oa;
+        }
+    }
 
-                        // RLE
-                        if (line_bytes)
-                        {
-                            s8 v = file_.getu8();
-                            --line_bytes;
+    bool get_layer_rect(const layered_image & img, u32 frame, u32 index, recti & r) {
+        const layer & l = img.layers_[index];
+        if (l.coverage_ == coverage_empty || !is_layer_visible(img, frame, index) || !get_layer_opacity(img, index))
+            return false;
 
-                            for (; count; --count, ++x)
-                                dest.set_single_channel(x, y, color_channel, v);
-                        }
-                    }
-                    else
-                    {
-                        int count = 1 + control_byte;
+        vi2 pos(l.offs_.x + l.bounds_offs_.x, l.offs_.y + l.bounds_offs_.y);
+        if (frame < img.frames_.size())
+        {
+            const animation & a = img.frames_[frame].layers_[index];
+            pos.x += a.offs_.x;
+            pos.y += a.offs_.y;
+        }
 
-                        // RAW
-                        for (; count && line_bytes; --line_bytes, --count, ++x)
-                            dest.set_single_channel(x, y, color_channel, file_.getu8());
-                    }
-                }
-            }
+        r = recti(pos.x, pos.y, pos.x + l.bounds_size_.x, pos.y + l.bounds_size_.y);
+        r = r.intersect(recti(0, 0, img.size_.x, img.size_.y));
+        return !r.empty();
+    }
+
+    void compose_region(const layered_image & img, u32 frame, std::vector < pixel > &dest, const recti & area) {
+        vi2 cs = img.size_;
+        recti region = area.intersect(recti(0, 0, cs.x, cs.y));
+        for (int y = region.y0; y < region.y1; ++y)
+        {
+            pixel *p = &dest[0] + (size_t) y * cs.x;
+            std::fill(p + region.x0, p + region.x1, pixel(0, 0, 0, 0));
         }
 
-        void parse_layer_channel_data(bitmap & dest) {
-            int cc = dest.get_channel_count();
-            for (int channel = 0; channel != cc; ++channel)
+        std::vector < pixel > row;
+        for (u32 i = 0; i != img.layers_.size(); ++i)
+        {
+            recti r;
+            if (!get_layer_rect(img, frame, i, r))
+                continue;
+
+            const layer & l = img.layers_[i];
+            vi2 pos(l.offs_.x + l.bounds_offs_.x, l.offs_.y + l.bounds_offs_.y);
+            if (frame < img.frames_.size())
             {
-                int color_channel = channel;
+                pos.x += img.frames_[frame].layers_[i].offs_.x;
+                pos.y += img.frames_[frame].layers_[i].offs_.y;
+            }
 
-                // if only RGB skip A in ARGB
-                if (cc == 3)
-                {
-                    color_channel++;
-                }
+            r = r.intersect(region);
+            if (r.empty())
+                continue;
 
-                u16 compression = file_.getu16();
+            u32 opacity = get_layer_opacity(img, i);
+            bool has_alpha = l.data_.has_alpha();
+            bool copy = l.coverage_ == coverage_opaque && opacity == 255;
+            int n = r.x1 - r.x0;
+            row.resize(l.data_.get_size().x);
 
-                switch (compression)
+            for (int y = r.y0; y != r.y1; ++y)
+            {
+                l.data_.get_row(y - pos.y + l.bounds_offs_.y, &row[0]);
+                const pixel *src = &row[r.x0 - pos.x + l.bounds_offs_.x];
+                pixel *dst = &dest[0] + (size_t) y * cs.x + r.x0;
+
+                if (copy)
                 {
-                    case 0:    // raw data
-                        parseRAWChannel(dest, color_channel);
-                        break;
-                    case 1:    // rle.. good
-                        parseRLEChannel(dest, color_channel);
-                        break;
-                    case 2:
-                    case 3:
-                        throw error_code_not_supported;
+                    std::copy(src, src + n, dst);
+                    if (!has_alpha)
+                        for (int x = 0; x != n; ++x)
+                            dst[x].v[0] = 255;
                 }
+                else
+                    blend_row(dst, src, n, opacity, has_alpha);
             }
         }
+    }
 
-        void parse_descriptor(u32 lvl, u32 node, layered_image & dest) {
+    void compose_frame(const layered_image & img, u32 frame, std::vector < pixel > &dest) {
+        dest.resize(img.size_.x * img.size_.y);
+        compose_region(img, frame, dest, recti(0, 0, img.size_.x, img.size_.y));
+    }
 
-            file_.skip_ustring();
+    frame_renderer::frame_renderer(const layered_image & img, u32 keyframe_interval, size_t budget)
+        :img_(img), keyframe_interval_(std::max(keyframe_interval, 1u)), budget_(budget), bytes_(0) {
+    }
 
-            u32 size = file_.getu32();
-            u32 id = file_.getu32();
-            u32 items = file_.getu32();
+    const std::vector < pixel > &frame_renderer::render(u32 frame) {
+        std::map < u32, std::vector < pixel > >::iterator k = keyframes_.find(frame);
+        if (k != keyframes_.end())
+            return k->second;
 
-            for (int i = 0; i < items; i++)
+        for (std::list < cached_frame >::iterator i = recent_.begin(); i != recent_.end(); ++i)
+        {
+            if (i->frame_ == frame)
             {
-                u32 key = file_.getKey();
-                u32 type = file_.getu32();
-                parse_type(lvl, i, node, key, type, dest);
+                recent_.splice(recent_.begin(), recent_, i);
+                return recent_.front().pixels_;
             }
         }
 
-        void parse_object_list(u32 lvl, u32 node, layered_image & dest) {
-            u32 items = file_.getu32();
-            for (int i = 0; i < items; i++)
+        // start from the cached frame with the least to recomposite
+        const std::vector < pixel > *base = 0;
+        std::vector < recti > dirty, best;
+        u64 best_area = (u64) img_.size_.x * img_.size_.y;
+
+        for (k = keyframes_.begin(); k != keyframes_.end(); ++k)
+        {
+            u64 area = get_dirty(k->first, frame, dirty);
+            if (area < best_area)
             {
-                u32 type = file_.getu32();
-                parse_type(lvl, i, node, 'VlLs', type, dest);
+                best_area = area;
+                best.swap(dirty);
+                base = &k->second;
             }
         }
-
-        void parse_type(u32 lvl, u32 idx, u32 node, u32 id, u32 type, layered_image & dest) {
-
-            LogParse("%s%c%c%c%c:%c%c%c%c\n", indent(lvl), VA_FCC(id), VA_FCC(type));
-
-            u8 vbool = 0;
-            s32 vlong = 0;
-            double vdouble = 0;
-
-            if (id == 'LaID')
-                next_layer();
-
-            if (id == 'VlLs' && lvl == 1)
-                next_frame();
-
-            switch (type)
+        for (std::list < cached_frame >::iterator i = recent_.begin(); i != recent_.end(); ++i)
+        {
+            u64 area = get_dirty(i->frame_, frame, dirty);
+            if (area < best_area)
             {
-                case 'VlLs':
-                    parse_object_list(lvl + 1, id, dest);
-                    break;
+                best_area = area;
+                best.swap(dirty);
+                base = &i->pixels_;
+            }
+        }
 
-                case 'Objc':
-                case 'GLbO':
-                    parse_descriptor(lvl + 1, id, dest);
-                    break;
+        std::vector < pixel > pixels;
+        if (base)
+        {
+            pixels = *base;
+            for (u32 i = 0; i != best.size(); ++i)
+                compose_region(img_, frame, pixels, best[i]);
+        }
+        else
+            compose_frame(img_, frame, pixels);
 
-                case 'bool':
-                    vbool = file_.getu8();
-                    LogParse("%s%d\n", indent(lvl + 1), vbool);
-                    break;
+        size_t bytes = pixels.size() * sizeof(pixel);
+        if (frame % keyframe_interval_ == 0 && keyframe_bytes() + bytes <= budget_)
+        {
+            std::vector < pixel > &dest = keyframes_[frame];
+            dest.swap(pixels);
+            bytes_ += bytes;
+            trim();
+            return dest;
+        }
 
-                case 'long':
-                    vlong = file_.gets32();
-                    LogParse("%s%d\n", indent(lvl + 1), vlong);
-                    break;
+        recent_.push_front(cached_frame());
+        recent_.front().frame_ = frame;
+        recent_.front().pixels_.swap(pixels);
+        bytes_ += bytes;
+        trim();
+        return recent_.front().pixels_;
+    }
 
-                case 'doub':
-                    vdouble = (double)file_.gets32();
-                    file_.gets32();
-                    LogParse("%s%f\n", indent(lvl + 1), vdouble);
-                    break;
+    size_t frame_renderer::keyframe_bytes() const {
+        return keyframes_.size() * img_.size_.x * img_.size_.y * sizeof(pixel);
+    }
 
-                case 'UntF':
-                    file_.gets32();
-                    file_.gets32();
-                    file_.gets32();
-                    break;
+    void frame_renderer::trim() {
+        // keep at least the frame just rendered
+        while (bytes_ > budget_ && recent_.size() > 1)
+        {
+            bytes_ -= recent_.back().pixels_.size() * sizeof(pixel);
+            recent_.pop_back();
+        }
+    }
 
-                case 'TEXT':
-                    file_.skip_ustring();
-                    break;
+    u64 frame_renderer::get_dirty(u32 from, u32 to, std::vector < recti > &dirty) const {
+        dirty.clear();
+        for (u32 i = 0; i != img_.layers_.size(); ++i)
+        {
+            recti a, b;
+            bool va = get_layer_rect(img_, from, i, a);
+            bool vb = get_layer_rect(img_, to, i, b);
+            if (va == vb && (!va || (a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1)))
+                continue;
+
+            if (va)
+                add_dirty(dirty, a);
+            if (vb)
+                add_dirty(dirty, b);
+        }
 
-                default:
-                    file_.gets32();
-                    break;
-            }
+        u64 area = 0;
+        for (u32 i = 0; i != dirty.size(); ++i)
+            area += dirty[i].area();
+        return area;
+    }
 
-            if (id == 'FrDl')
+    void frame_renderer::add_dirty(std::vector < recti > &dirty, recti r) {
+        for (u32 i = 0; i != dirty.size();)
+        {
+            if (!dirty[i].intersect(r).empty())
             {
-                set_frame_delay(dest, vlong);
+                r = r.unite(dirty[i]);
+                dirty.erase(dirty.begin() + i);
+                i = 0;
             }
+            else
+                ++i;
+        }
+        dirty.push_back(r);
+    }
 
-            if (id == 'enab')
-            {
-                set_layer_visible(dest, vbool);
-            }
+    quantizer::quantizer():frames_(0), first_color_(0) {
+        frame_hist_.resize(BINS + 1);
+        since_.resize(BINS + 1);
+        total_.resize(BINS + 1);
+    }
 
-            if (node == 'Ofst')
+    void quantizer::add_frame(const std::vector < pixel > &frame, int width, const std::vector < recti > &changed) {
+        if (prev_.size() != frame.size() || width <= 0)
+        {
+            for (u32 b = 0; b != BINS + 1; ++b)
             {
-                if (id == 'Hrzn')
-                    set_layer_dx(dest, vlong);
-                if (id == 'Vrtc')
-                    set_frame_layer_dy(dest, vlong);
+                flush_bin(b);
+                frame_hist_[b] = 0;
             }
+            for (u32 i = 0; i != frame.size(); ++i)
+                frame_hist_[get_bin(frame[i])]++;
+            prev_ = frame;
         }
-
-        void parse_metadata(layered_image & dest) {
-            u32 size = file_.getu32();
-            u32 items = file_.getu32();
-
-            for (int i = 0; i < items; i++)
+        else
+        {
+            recti canvas(0, 0, width, (int)(frame.size() / width));
+            for (u32 r = 0; r != changed.size(); ++r)
             {
-                u32 sig = file_.getu32();
-                u32 key = file_.getu32();
-                u32 unk = file_.getu32();
+                recti c = changed[r].intersect(canvas);
+                if (c.empty())
+                    continue;
 
-                switch (key)
+                for (int y = c.y0; y != c.y1; ++y)
                 {
-                    case 'mlst':
-                        parse_animation_metadata(dest);
-                        break;
-                    default:
-                        skip_block();
-                        break;
+                    for (int i = y * width + c.x0; i != y * width + c.x1; ++i)
+                    {
+                        if (!memcmp(&frame[i], &prev_[i], sizeof(pixel)))
+                            continue;
+                        move_pixel(get_bin(prev_[i]), get_bin(frame[i]));
+                        prev_[i] = frame[i];
+                    }
                 }
             }
         }
 
-        void parse_layer_addinfo(layered_image & dest) {
-            u32 sig = file_.getu32();
-            u32 key = file_.getu32();
+        frames_++;
+    }
 
-            switch (key)
-            {
-                case 'shmd':
-                    parse_metadata(dest);
-                    break;
+    // add the frames the bin count held for since it last changed
+    void quantizer::flush_bin(u32 bin) {
+        total_[bin] += (u64) frame_hist_[bin] * (frames_ - since_[bin]);
+        since_[bin] = frames_;
+    }
 
-                default:
-                    skip_block();
-                    break;
-            }
+    void quantizer::move_pixel(u32 from, u32 to) {
+        if (from == to)
+            return;
+
+        flush_bin(from);
+        flush_bin(to);
+        frame_hist_[from]--;
+        frame_hist_[to]++;
+    }
+
+    struct color_box {
+        u32 begin, end;    // range in the sorted bin list
+        u32 channel;    // widest channel
+        u32 range;
+    };
+
+    struct bin_channel_less {
+        bin_channel_less(u32 channel):shift_(10 - channel * 5) {
         }
 
-        void parse_layer_pixel_data(layered_image & dest) {
-            for (u32 i = 0; i != dest.layers_.size(); ++i)
-                parse_layer_channel_data(dest.layers_[i].data_);
+        bool operator() (u32 a, u32 b) const {
+            return ((a >> shift_) & 31) < ((b >> shift_) & 31);
         }
 
-        void parse_layer_record(layered_image & dest) {
-            u32 top = file_.getu32();
-            u32 left = file_.getu32();
-            u32 bottom = file_.getu32();
-            u32 right = file_.getu32();
+        u32 shift_;
+    };
 
-            u16 channel_count = file_.getu16();
-            file_.skip(6 * channel_count);    // skip channel length info
+    inline void measure_box(const std::vector < u32 > &bins, color_box & box) {
+        u32 lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 };
+        for (u32 i = box.begin; i != box.end; ++i)
+        {
+            for (u32 c = 0; c != 3; ++c)
+            {
+                u32 v = (bins[i] >> (10 - c * 5)) & 31;
+                lo[c] = std::min(lo[c], v);
+                hi[c] = std::max(hi[c], v);
+            }
+        }
 
-            u32 blend_mode_sig = file_.getu32();
-            (void)blend_mode_sig;
+        box.channel = 0;
+        for (u32 c = 1; c != 3; ++c)
+            if (hi[c] - lo[c] > hi[box.channel] - lo[box.channel])
+                box.channel = c;
+        box.range = hi[box.channel] - lo[box.channel];
+    }
 
-            u32 blend_mode_key = file_.getu32();
-            (void)blend_mode_key;
+    void quantizer::build_palette(u32 colors) {
+        palette_.clear();
+        lut_.assign(BINS, 0xffff);
 
-            u8 opacity = file_.getu8();
-            (void)opacity;
+        for (u32 b = 0; b != BINS + 1; ++b)
+            flush_bin(b);
 
-            u8 clipping = file_.getu8();
-            (void)clipping;
+        first_color_ = total_[TRANSPARENT_BIN] ? 1 : 0;
+        if (first_color_)
+            palette_.push_back(pixel(0, 0, 0, 0));
 
-            u8 flags = file_.getu8();
-            (void)flags;
+        std::vector < u32 > bins;
+        for (u32 b = 0; b != BINS; ++b)
+            if (total_[b])
+                bins.push_back(b);
 
-            u8 filler = file_.getu8();
-            (void)filler;
+        if (bins.empty() || colors <= first_color_)
+            return;
 
-            u32 extra_size = file_.getu32();
-            size_t endpos = file_.get_pos() + extra_size;
+        std::vector < color_box > boxes(1);
+        boxes[0].begin = 0;
+        boxes[0].end = (u32) bins.size();
+        measure_box(bins, boxes[0]);
 
-            skip_block();    // layer mask adjustment data
-            skip_block();    // layer blending ranges
+        while (boxes.size() < colors - first_color_)
+        {
+            u32 best = 0;
+            for (u32 i = 1; i != boxes.size(); ++i)
+                if (boxes[i].range > boxes[best].range)
+                    best = i;
+
+            color_box box = boxes[best];
+            if (!box.range)
+                break;
+
+            // split at the weighted median of the widest channel
+            std::sort(bins.begin() + box.begin, bins.begin() + box.end, bin_channel_less(box.channel));
+            u64 weight = 0, half = 0;
+            for (u32 i = box.begin; i != box.end; ++i)
+                weight += total_[bins[i]];
+
+            u32 split = box.begin + 1;
+            for (u32 i = box.begin; i != box.end - 1; ++i)
+            {
+                half += total_[bins[i]];
+                split = i + 1;
+                if (half * 2 >= weight)
+                    break;
+            }
 
-            // "Pascal string, padded to a multiple of 4 bytes"
-            size_t p0 = file_.get_pos();
-            std::string l_name;
-            int len = file_.get_pstring(l_name);
-            len = round_int(len, 4);
-            file_.set_pos(p0 + len);
+            color_box hi = box;
+            boxes[best].end = hi.begin = split;
+            measure_box(bins, boxes[best]);
+            measure_box(bins, hi);
+            boxes.push_back(hi);
+        }
 
-            while (file_.get_pos() < endpos)
-                parse_layer_addinfo(dest);
+        for (u32 i = 0; i != boxes.size(); ++i)
+        {
+            u64 sum[3] = { 0, 0, 0 }, weight = 0;
+            for (u32 j = boxes[i].begin; j != boxes[i].end; ++j)
+            {
+                u32 b = bins[j];
+                u64 w = total_[b];
+                for (u32 c = 0; c != 3; ++c)
+                    sum[c] += w * ((((b >> (10 - c * 5)) & 31) << 3) | 4);
+                weight += w;
+            }
+            palette_.push_back(pixel(255, (u8) (sum[0] / weight), (u8) (sum[1] / weight), (u8) (sum[2] / weight)));
+        }
+    }
 
-            file_.set_pos(endpos);
+    u8 quantizer::nearest(u32 bin) {
+        u16 & index = lut_[bin];
+        if (index != 0xffff)
+            return (u8) index;
 
-            // add layer to dest
-            dest.layers_.push_back(layer());
-            layer & l = dest.layers_.back();
-            l.name_ = l_name;
-            l.offs_.set(left, top);
-            l.data_.resize(right - left, bottom - top);
-            l.data_.set_channel_count(channel_count);
+        int r = (((bin >> 10) & 31) << 3) | 4;
+        int g = (((bin >> 5) & 31) << 3) | 4;
+        int b = ((bin & 31) << 3) | 4;
 
-            l.flags = flags;
+        int best = INT_MAX;
+        index = first_color_;
+        for (u32 i = first_color_; i < palette_.size(); ++i)
+        {
+            const pixel & p = palette_[i];
+            int dr = p.v[1] - r, dg = p.v[2] - g, db = p.v[3] - b;
+            int d = dr * dr + dg * dg + db * db;
+            if (d < best)
+            {
+                best = d;
+                index = (u16) i;
+            }
         }
+        return (u8) index;
+    }
 
-        void parse_layer_structure(layered_image & dest) {
-            s16 l_count = (s16) abs(file_.gets16());
+    void quantizer::map_frame(const std::vector < pixel > &frame, int width, bool dither, std::vector < u8 > &dest) {
+        dest.resize(frame.size());
+        if (palette_.size() <= first_color_ || width <= 0)
+        {
+            std::fill(dest.begin(), dest.end(), 0);
+            return;
+        }
 
-            for (int i = 0; i != l_count; ++i)
-                parse_layer_record(dest);
+        if (!dither)
+        {
+            for (u32 i = 0; i != frame.size(); ++i)
+            {
+                u32 bin = get_bin(frame[i]);
+                dest[i] = bin == TRANSPARENT_BIN ? 0 : nearest(bin);
+            }
+            return;
+        }
 
-            file_.pad_even();
+        // Floyd-Steinberg, errors in 1/16 units for this row and the next
+        int height = (int)(frame.size() / width);
+        std::vector < int >err0((width + 2) * 3), err1((width + 2) * 3);
+        for (int y = 0; y != height; ++y)
+        {
+            std::fill(err1.begin(), err1.end(), 0);
+            for (int x = 0; x != width; ++x)
+            {
+                const pixel & p = frame[y * width + x];
+                if (get_bin(p) == TRANSPARENT_BIN)
+                {
+                    dest[y * width + x] = 0;
+                    continue;
+                }
+
+                int c[3];
+                for (u32 k = 0; k != 3; ++k)
+                    c[k] = std::min(std::max(p.v[k + 1] + err0[(x + 1) * 3 + k] / 16, 0), 255);
+
+                u8 index = nearest(((c[0] >> 3) << 10) | ((c[1] >> 3) << 5) | (c[2] >> 3));
+                dest[y * width + x] = index;
+
+                for (u32 k = 0; k != 3; ++k)
+                {
+                    int e = c[k] - palette_[index].v[k + 1];
+                    err0[(x + 2) * 3 + k] += e * 7;
+                    err1[(x + 0) * 3 + k] += e * 3;
+                    err1[(x + 1) * 3 + k] += e * 5;
+                    err1[(x + 2) * 3 + k] += e;
+                }
+            }
+            err0.swap(err1);
         }
+    }
 
-        void parse_layer_info(layered_image & dest) {
-            u32 size = file_.getu32();
+    inline void put_bmp_header(output_file & out, int width, int height, u32 bits, u32 palette_size, u32 data_size) {
+        u32 data_offset = 14 + 40 + palette_size * 4;
+
+        // BITMAPFILEHEADER
+        out.putu16('B' | ('M' << 8));
+        out.putu32(data_offset + data_size);
+        out.putu32(0);
+        out.putu32(data_offset);
+
+        // BITMAPINFOHEADER
+        out.putu32(40);
+        out.puts32(width);
+        out.puts32(height);
+        out.putu16(1);
+        out.putu16(bits);
+        out.putu32(0);
+        out.putu32(data_size);
+        out.putu32(2835);
+        out.putu32(2835);
+        out.putu32(palette_size);
+        out.putu32(0);
+    }
 
-            size_t endpos = file_.get_pos() + size;
+    error_code write_bmp(const char *fname, const bitmap & src) {
+        vi2 s = src.get_size();
+        bool has_alpha = src.has_alpha();
 
-            parse_layer_structure(dest);
-            parse_layer_pixel_data(dest);
+        output_file out(fname);
+        if (!out.is_open())
+            return error_code_write_failed;
 
-            file_.set_pos(endpos);
+        put_bmp_header(out, s.x, s.y, 32, 0, s.x * s.y * 4);
+
+        // bottom-up rows
+        std::vector < pixel > row(s.x);
+        std::vector < u8 > bgra(s.x * 4);
+        for (int y = s.y - 1; y >= 0; --y)
+        {
+            src.get_row(y, &row[0]);
+            for (int x = 0; x != s.x; ++x)
+            {
+                pixel & p = row[x];
+                bgra[x * 4 + 0] = p.b();
+                bgra[x * 4 + 1] = p.g();
+                bgra[x * 4 + 2] = p.r();
+                bgra[x * 4 + 3] = has_alpha ? p.a() : 255;
+            }
+            if (s.x)
+                out.put(&bgra[0], bgra.size());
         }
 
-        void parse_layer_and_mask(layered_image & dest) {
-            u32 size = file_.getu32();
-            size_t endpos = file_.get_pos() + size;
+        if (!out.close())
+            return error_code_write_failed;
 
-            parse_layer_info(dest);
-            skip_block();    // parse_mask_info( dest, ptr, stop );
+        return error_code_no_error;
+    }
 
-            file_.set_pos(endpos);
+    error_code write_indexed_bmp(const char *fname, int width, int height, const std::vector < pixel > &palette,
+        const std::vector < u8 > &indices) {
+        u32 stride = round_int(width, 4);
+
+        output_file out(fname);
+        if (!out.is_open())
+            return error_code_write_failed;
+
+        put_bmp_header(out, width, height, 8, 256, stride * height);
+
+        for (u32 i = 0; i != 256; ++i)
+        {
+            pixel p = i < palette.size() ? palette[i] : pixel(0, 0, 0, 0);
+            u8 bgrx[4] = { p.b(), p.g(), p.r(), 0 };
+            out.put(bgrx, 4);
         }
 
-public:
-        void parse_layered_image(layered_image & dest) {
-            parse_header(dest);
-            skip_block();    //parse_color_data( dest );
-            parse_image_resources(dest);
-            parse_layer_and_mask(dest);
-            // skip composite image...
+        // bottom-up rows
+        std::vector < u8 > line(stride);
+        for (int y = height - 1; y >= 0; --y)
+        {
+            std::copy(indices.begin() + y * width, indices.begin() + (y + 1) * width, line.begin());
+            out.put(&line[0], stride);
         }
-    };
 
-    error_code load_layered_image(layered_image & dest, const char *fname) {
-        try
+        if (!out.close())
+            return error_code_write_failed;
+
+        return error_code_no_error;
+    }
+
+    inline void hash_bytes(u64 & h, const void *data, size_t bytes) {
+        const u8 *p = (const u8 *)data;
+        for (size_t i = 0; i != bytes; ++i)
+            h = (h ^ p[i]) * 1099511628211ull;
+    }
+
+    inline void hash_int(u64 & h, s32 v) {
+        hash_bytes(h, &v, sizeof(v));
+    }
+
+    inline void hash_rows(u64 & h, const bitmap & b, const vi2 & o, const vi2 & s) {
+        std::vector < pixel > row(b.get_size().x);
+        for (int y = 0; y < s.y; ++y)
         {
-            // clear dest
-            dest.layers_.clear();
-            dest.size_.set(0, 0);
+            b.get_row(o.y + y, &row[0]);
+            hash_bytes(h, &row[o.x], s.x * sizeof(pixel));
+        }
+    }
 
-            // load file
-            buffered_file file(fname);
+    u64 hash_layered_image(const layered_image & img) {
+        u64 h = 14695981039346656037ull;
+        hash_int(h, img.size_.x);
+        hash_int(h, img.size_.y);
 
-            loader l(file);
-            l.parse_layered_image(dest);
+        for (u32 i = 0; i != img.layers_.size(); ++i)
+        {
+            const layer & l = img.layers_[i];
+            hash_bytes(h, l.name_.c_str(), l.name_.size() + 1);
+            hash_int(h, l.offs_.x);
+            hash_int(h, l.offs_.y);
+            hash_int(h, l.flags);
+            hash_int(h, l.opacity_);
+            hash_int(h, l.blend_mode_);
+            hash_int(h, l.section_);
+            hash_int(h, l.parent_);
+            hash_int(h, l.culled_);
+            hash_int(h, l.coverage_);
+            hash_int(h, l.bounds_offs_.x);
+            hash_int(h, l.bounds_offs_.y);
+            hash_int(h, l.bounds_size_.x);
+            hash_int(h, l.bounds_size_.y);
+            hash_rows(h, l.data_, l.bounds_offs_, l.bounds_size_);
         }
-        catch(error_code e)
+
+        for (u32 f = 0; f != img.frames_.size(); ++f)
         {
-            return e;
+            const frame & fr = img.frames_[f];
+            hash_int(h, fr.delay_);
+            for (u32 i = 0; i != fr.layers_.size(); ++i)
+            {
+                hash_int(h, fr.layers_[i].enabled);
+                hash_int(h, fr.layers_[i].offs_.x);
+                hash_int(h, fr.layers_[i].offs_.y);
+            }
         }
-        catch(...)
+
+        for (u32 k = 0; k != img.mips_.size(); ++k)
         {
-            return error_code_invalid_file;
+            u64 m = hash_layered_image(img.mips_[k]);
+            hash_bytes(h, &m, sizeof(m));
         }
 
-        return error_code_no_error;
+        hash_rows(h, img.composite_, vi2(), img.composite_.get_size());
+        return h;
+    }
+}
+
+static void log_to_string(void *user, const char *msg)
+{
+    ((std::string *) user)->append(msg);
+}
+
+// everything one load produces: error, document, log and stats
+static psdlite::u64 load_digest(const char *fname, const psdlite::load_options & base)
+{
+    using namespace psdlite;
+
+    layered_image img;
+    load_options opts = base;
+    load_stats stats;
+    std::string log;
+    opts.log_ = log_to_string;
+    opts.log_user_ = &log;
+    opts.stats_ = &stats;
+
+    u64 h = hash_layered_image(img);
+    error_code code = load_layered_image(img, fname, opts);
+    hash_int(h, code);
+    u64 doc = hash_layered_image(img);
+    hash_bytes(h, &doc, sizeof(doc));
+    hash_bytes(h, log.c_str(), log.size());
+    hash_int(h, stats.layers_);
+    hash_int(h, stats.layers_decoded_);
+    hash_int(h, stats.layers_culled_);
+    hash_int(h, stats.frames_);
+    hash_bytes(h, &stats.channel_bytes_, sizeof(stats.channel_bytes_));
+    return h;
+}
+
+// Loads every file on many threads at once and checks each result against
+// a single-threaded load of the same file.
+static int run_stress(const std::vector < const char *>&files, int threads, const psdlite::load_options & opts)
+{
+    using namespace psdlite;
+
+    const int rounds = 8;
+    std::vector < u64 > expected(files.size());
+    for (u32 i = 0; i != files.size(); ++i)
+        expected[i] = load_digest(files[i], opts);
+
+    std::atomic < int >mismatches(0);
+    std::vector < std::thread > pool;
+    for (int t = 0; t != threads; ++t)
+    {
+        pool.push_back(std::thread([&, t]() {
+            for (int r = 0; r != rounds; ++r)
+            {
+                for (u32 k = 0; k != files.size(); ++k)
+                {
+                    u32 i = (u32) ((k + t + r) % files.size());
+                    if (load_digest(files[i], opts) != expected[i])
+                        mismatches++;
+                }
+            }
+        }));
     }
+    for (u32 t = 0; t != pool.size(); ++t)
+        pool[t].join();
+
+    LogStdio("stress: %d threads, %d loads, %d mismatches\n", threads, threads * rounds * (int)files.size(), (int)mismatches);
+    return mismatches ? 1 : 0;
 }
 
 int main(int argc, char **argv)
@@ -814,7 +3107,45 @@ int main(int argc, char **argv)
     using namespace psdlite;
 
     layered_image img;
-    const char *filename = (argc >= 2) ? argv[1] : "anim.psd";
+    load_options opts;
+    const char *filename = "anim.psd";
+    std::vector < const char *>files;
+    int stress_threads = 0;
+    const char *bundle_name = 0;
+    int indexed_colors = 0;
+    bool dither = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-tiles") && i + 1 < argc)
+            opts.tile_budget_ = (size_t)atoi(argv[++i]) << 20;
+        else if (!strcmp(argv[i], "-bundle") && i + 1 < argc)
+            bundle_name = argv[++i];
+        else if (!strcmp(argv[i], "-indexed") && i + 1 < argc)
+            indexed_colors = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-dither"))
+            dither = true;
+        else if (!strcmp(argv[i], "-mips") && i + 1 < argc)
+            opts.mip_levels_ = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-nofull"))
+            opts.keep_full_ = false;
+        else if (!strcmp(argv[i], "-preview") && i + 1 < argc)
+        {
+            opts.composite_only_ = true;
+            opts.composite_level_ = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-stress") && i + 1 < argc)
+            stress_threads = atoi(argv[++i]);
+        else
+            files.push_back(filename = argv[i]);
+    }
+
+    if (stress_threads > 0)
+    {
+        if (files.empty())
+            files.push_back(filename);
+        return run_stress(files, stress_threads, opts);
+    }
 
     char *basename = strdup(filename);
     //remove extension, if any
@@ -824,7 +3155,7 @@ int main(int argc, char **argv)
 
     LogStdio("Loading %s\n", filename);
 
-    int code = load_layered_image(img, filename);
+    int code = load_layered_image(img, filename, opts);
 
     if (code)
     {
@@ -832,6 +3163,20 @@ int main(int argc, char **argv)
         exit(code);
     }
 
+    if (opts.composite_only_)
+    {
+        std::string name = std::string(basename) + "_preview.bmp";
+        vi2 s = img.composite_.get_size();
+        LogStdio("Writing %s w,h=%d,%d\n", name.c_str(), s.x, s.y);
+        code = write_bmp(name.c_str(), img.composite_);
+        if (code)
+        {
+            LogStdio("ERROR: %d\n", code);
+            exit(code);
+        }
+        return 0;
+    }
+
     u32 lc = (u32) img.layers_.size();
 
 
@@ -839,31 +3184,98 @@ int main(int argc, char **argv)
     {
         layer & l = img.layers_[i];
 
-        LogStdio("name: '%s' x,y=%d,%d w,h=%d,%d flags=%d\n", 
-            l.name_.c_str(), l.offs_.x, l.offs_.y, l.data_.get_size().x, l.data_.get_size().y, l.flags);
+        LogStdio("name: '%s' x,y=%d,%d w,h=%d,%d flags=%d bounds=%d,%d,%d,%d coverage=%d parent=%d%s\n", 
+            l.name_.c_str(), l.offs_.x, l.offs_.y, l.data_.get_size().x, l.data_.get_size().y, l.flags,
+            l.bounds_offs_.x, l.bounds_offs_.y, l.bounds_size_.x, l.bounds_size_.y, l.coverage_, l.parent_,
+            l.culled_ ? " culled" : "");
 
         bool hidden = (l.flags & 2);
 
-        if (!hidden)
+        if (!hidden && l.coverage_ != coverage_empty)
         {
             bitmap & b = l.data_;
-            vi2 s = b.get_size();
+            vi2 o = l.bounds_offs_;
+            vi2 s = l.bounds_size_;
             u8* mem = (u8*)malloc(s.x * s.y * 4);
+            std::vector < pixel > row(b.get_size().x);
             int count = 0;
             for (int y = 0; y != s.y; ++y)
             {
+                b.get_row(o.y + y, &row[0]);
                 for (int x = 0; x != s.x; ++x)
                 {
-                    pixel p = b.get_pixel(x, y);
+                    pixel & p = row[o.x + x];
                     mem[count++] = p.b();
                     mem[count++] = p.g();
                     mem[count++] = p.r();
                     mem[count++] = p.a();
                 }
             }
+            free(mem);
+        }
+    }
+
+    for (u32 k = 0; k != img.mips_.size(); ++k)
+        LogStdio("mip %d: w,h=%d,%d\n", k + 1, img.mips_[k].size_.x, img.mips_[k].size_.y);
+
+    // full resolution first, then mip k as name_k.ext
+    for (u32 k = opts.keep_full_ ? 0 : 1; bundle_name && k <= img.mips_.size(); ++k)
+    {
+        std::string name = bundle_name;
+        if (k)
+        {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), "_%d", k);
+            size_t dot = name.rfind('.');
+            name.insert(dot == std::string::npos ? name.size() : dot, suffix);
+        }
+
+        LogStdio("Writing %s\n", name.c_str());
+        code = write_anim_bundle(k ? img.mips_[k - 1] : img, name.c_str());
+        if (code)
+        {
+            LogStdio("ERROR: %d\n", code);
+            exit(code);
+        }
+    }
+
+    if (indexed_colors > 0 && (opts.keep_full_ || !img.mips_.empty()))
+    {
+        // the largest level that was kept
+        const layered_image & src = opts.keep_full_ ? img : img.mips_[0];
+        u32 fc = get_frame_count(src);
+        std::vector < u8 > indices;
+        frame_renderer renderer(src);
+        quantizer q;
+
+        std::vector < recti > changed;
+        for (u32 f = 0; f != fc; ++f)
+        {
+            if (f)
+                renderer.get_dirty(f - 1, f, changed);
+            q.add_frame(renderer.render(f), src.size_.x, changed);
+        }
+        q.build_palette(std::min(indexed_colors, 256));
+        LogStdio("Palette: %d colors\n", (int)q.get_palette().size());
+
+        for (u32 f = 0; f != fc; ++f)
+        {
+            char name[1024];
+            snprintf(name, sizeof(name), "%s_%03d.bmp", basename, f);
+
+            q.map_frame(renderer.render(f), src.size_.x, dither, indices);
+            code = write_indexed_bmp(name, src.size_.x, src.size_.y, q.get_palette(), indices);
+            if (code)
+            {
+                LogStdio("ERROR: %d\n", code);
+                exit(code);
+            }
         }
     }
 
+    if (img.tiles_.enabled())
+        LogStdio("tiles: %u KB resident, %u KB packed, %u evictions\n",
+            (u32) (img.tiles_.get_resident_bytes() >> 10), (u32) (img.tiles_.get_packed_bytes() >> 10), img.tiles_.get_evictions());
+
     return 0;
 }
-